@@ -0,0 +1,6 @@
+/*
+ * Generated file. DO NOT EDIT!
+ */
+
+#define PACKAGE_NAME       "lubi"
+#define PACKAGE_VERSION    "0.1.5"
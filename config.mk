@@ -0,0 +1,23 @@
+#
+# Generated file. DO NOT EDIT!
+#
+
+VERSION = 0.1.5
+
+PREFIX ?= /usr/local
+EPREFIX ?= /usr/local
+BINDIR ?= /usr/local/bin
+SBINDIR ?= /usr/local/sbin
+LIBEXECDIR ?= /usr/local/libexec
+SYSCONFDIR ?= /usr/local/etc
+LOCALSTATEDIR ?= /usr/local/var
+DATADIR ?= /usr/local/share
+
+ENABLE_DEBUG ?= 
+ENABLE_TESTS ?= 
+
+CFLAGS += 
+CPPFLAGS += 
+LDFLAGS += 
+
+CC = gcc
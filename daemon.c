@@ -0,0 +1,640 @@
+/*
+ * Daemon mode of the example program
+ *
+ * The daemon keeps the dumps it was asked about attached, up to
+ * DMN_DUMPS_MAX of them, and the LEBs it read from them once verified, up
+ * to cache_sz bytes, so that repeated requests only cost the data sent
+ * back; the least recently used ones go first. A dump which changed on
+ * disk (inode, size or mtime) is attached again and its LEBs dropped.
+ *
+ * One request per connection, a line:
+ *	LIST peb_sz peb_min peb_nb path
+ *	READ peb_sz peb_min peb_nb offset len volume path
+ * answered with "OK size\n" followed by size bytes, or "ERR message\n";
+ * LIST answers a line per volume: "vol_id static|dynamic reserved_lebs
+ * leb_sz name", READ the bytes [offset, offset + len) of the volume, len
+ * -1 reading up to its end
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <err.h>
+
+#include "liblubi.h"
+#include "flash_io.h"
+#include "daemon.h"
+
+#define DMN_DUMPS_MAX		8
+#define DMN_VOLS_MAX		128
+#define DMN_REQ_MAX		(PATH_MAX + 128)
+#define DMN_IO_ALIGN		64
+
+struct dmn_dump {
+	char path[PATH_MAX];
+	int peb_sz;
+	int peb_min;
+	int peb_nb;
+	struct stat sb;			// as attached
+	struct fio fio;
+	void *lubi_priv;		// NULL for a free slot
+	unsigned int gen;		// tags its LEBs in the cache
+	long long vol_len[DMN_VOLS_MAX];	// -1 until read to the end
+	unsigned long long last_use;
+};
+
+struct dmn_leb {
+	unsigned int gen;
+	int vol_id;
+	unsigned int lnum;
+	int len;
+	uint8_t *buf;			// NULL for an unmapped LEB (0xFF)
+	unsigned long long last_use;
+};
+
+struct dmn {
+	const struct dmn_opts *opts;
+	struct dmn_dump dumps[DMN_DUMPS_MAX];
+	struct dmn_leb *lebs;
+	int lebs_nb;
+	int lebs_max;
+	long long cached;		// bytes held by lebs[]
+	unsigned long long tick;	// LRU clock
+	unsigned int gen;
+};
+
+// Volume read on behalf of a READ request
+struct dmn_rd {
+	struct dmn *d;
+	struct dmn_dump *dump;
+	int vol_id;
+	int leb_sz;
+	long long off, end;		// range requested
+	uint8_t *out;
+	long long last;			// LEB past which to stop, -1 for none
+	int stopped;
+	int lebs;			// LEBs read
+};
+
+static int dmn_flash_read(void *priv, void *dst, int pnum, int offset, int len)
+{
+	return fio_read(priv, dst, pnum, offset, len);
+}
+
+static void dmn_prefetch(void *priv, int pnum, int offset, int len)
+{
+	fio_prefetch(priv, pnum, offset, len);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Reads a line into line[max], without its '\n'
+ */
+static int read_line(int fd, char *line, int max)
+{
+	for (int n = 0; n < max - 1; ) {
+		ssize_t ret = read(fd, &line[n], 1);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		if (line[n] == '\n') {
+			line[n] = '\0';
+			return n;
+		}
+		n++;
+	}
+	return -1;
+}
+
+static void dmn_reply_err(int fd, const char *msg)
+{
+	char line[256];
+	int n = snprintf(line, sizeof(line), "ERR %s\n", msg);
+
+	write_all(fd, line, n);
+}
+
+static void dmn_reply(int fd, const void *buf, long long len)
+{
+	char line[32];
+	int n = snprintf(line, sizeof(line), "OK %lld\n", len);
+
+	if (!write_all(fd, line, n))
+		write_all(fd, buf, len);
+}
+
+/*
+ * LEB cache
+ */
+static void dmn_leb_del(struct dmn *d, int i)
+{
+	d->cached -= d->lebs[i].buf ? d->lebs[i].len : 0;
+	free(d->lebs[i].buf);
+	d->lebs[i] = d->lebs[--d->lebs_nb];
+}
+
+static struct dmn_leb *dmn_leb_find(struct dmn *d, unsigned int gen,
+				    int vol_id, unsigned int lnum)
+{
+	for (int i = 0; i < d->lebs_nb; i++) {
+		struct dmn_leb *leb = &d->lebs[i];
+
+		if (leb->gen == gen && leb->vol_id == vol_id &&
+		    leb->lnum == lnum) {
+			leb->last_use = ++d->tick;
+			return leb;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Keeps a copy of a verified LEB, evicting the least recently used ones
+ * to make room for it
+ */
+static void dmn_leb_put(struct dmn *d, unsigned int gen, int vol_id,
+			unsigned int lnum, const void *buf, int len)
+{
+	long long sz = buf ? len : 0;
+	struct dmn_leb *leb;
+
+	if (sz > d->opts->cache_sz || dmn_leb_find(d, gen, vol_id, lnum))
+		return;
+
+	while (d->lebs_nb && d->cached + sz > d->opts->cache_sz) {
+		int lru = 0;
+
+		for (int i = 1; i < d->lebs_nb; i++)
+			if (d->lebs[i].last_use < d->lebs[lru].last_use)
+				lru = i;
+		dmn_leb_del(d, lru);
+	}
+
+	if (d->lebs_nb == d->lebs_max) {
+		int max = d->lebs_max ? 2 * d->lebs_max : 64;
+		struct dmn_leb *lebs = realloc(d->lebs, max * sizeof(*lebs));
+
+		if (!lebs)
+			return;
+		d->lebs = lebs;
+		d->lebs_max = max;
+	}
+
+	leb = &d->lebs[d->lebs_nb];
+	leb->buf = NULL;
+	if (buf && !(leb->buf = malloc(len)))
+		return;
+	if (buf)
+		memcpy(leb->buf, buf, len);
+	leb->gen = gen;
+	leb->vol_id = vol_id;
+	leb->lnum = lnum;
+	leb->len = len;
+	leb->last_use = ++d->tick;
+	d->cached += sz;
+	d->lebs_nb++;
+}
+
+static void dmn_leb_purge(struct dmn *d, unsigned int gen)
+{
+	for (int i = d->lebs_nb - 1; i >= 0; i--)
+		if (d->lebs[i].gen == gen)
+			dmn_leb_del(d, i);
+}
+
+/*
+ * Attached dumps
+ */
+static void dmn_dump_close(struct dmn *d, struct dmn_dump *dump)
+{
+	if (!dump->lubi_priv)
+		return;
+	dmn_leb_purge(d, dump->gen);
+	fio_close(&dump->fio);
+	free(dump->lubi_priv);
+	dump->lubi_priv = NULL;
+}
+
+static int dmn_dump_open(struct dmn *d, struct dmn_dump *dump,
+			 const struct dmn_req *req, const struct stat *sb)
+{
+	const struct dmn_opts *opts = d->opts;
+
+	if (fio_open(&dump->fio, req->path, opts->io, opts->qd, req->peb_sz))
+		return -1;
+	if (posix_memalign(&dump->lubi_priv, DMN_IO_ALIGN, lubi_mem_sz())) {
+		dump->lubi_priv = NULL;
+		fio_close(&dump->fio);
+		return -1;
+	}
+
+	snprintf(dump->path, sizeof(dump->path), "%s", req->path);
+	dump->peb_sz = req->peb_sz;
+	dump->peb_min = req->peb_min;
+	dump->peb_nb = req->peb_nb ? req->peb_nb :
+		       dump->fio.size / dump->fio.peb_stride;
+	dump->sb = *sb;
+	dump->gen = ++d->gen;
+	for (int i = 0; i < DMN_VOLS_MAX; i++)
+		dump->vol_len[i] = -1;
+
+	if (lubi_init(dump->lubi_priv, &dump->fio, dmn_flash_read,
+		      dump->peb_sz, dump->peb_min, dump->peb_nb) ||
+	    (opts->io != FIO_MMAP &&
+	     lubi_set_prefetch(dump->lubi_priv, dmn_prefetch, opts->qd)) ||
+	    lubi_attach(dump->lubi_priv, 0, 0)) {
+		dmn_dump_close(d, dump);
+		return -1;
+	}
+
+	fprintf(stderr, "attached %s\n", dump->path);
+	return 0;
+}
+
+/**
+ * The dump of the request, attached again if it changed on disk
+ */
+static struct dmn_dump *dmn_dump_get(struct dmn *d, const struct dmn_req *req)
+{
+	struct dmn_dump *dump = NULL;
+	struct stat sb;
+
+	if (stat(req->path, &sb))
+		return NULL;
+
+	for (int i = 0; i < DMN_DUMPS_MAX && !dump; i++) {
+		struct dmn_dump *cur = &d->dumps[i];
+
+		if (cur->lubi_priv && !strcmp(cur->path, req->path) &&
+		    cur->peb_sz == req->peb_sz && cur->peb_min == req->peb_min &&
+		    (!req->peb_nb || cur->peb_nb == req->peb_nb))
+			dump = cur;
+	}
+
+	if (dump && dump->sb.st_ino == sb.st_ino &&
+	    dump->sb.st_size == sb.st_size &&
+	    dump->sb.st_mtim.tv_sec == sb.st_mtim.tv_sec &&
+	    dump->sb.st_mtim.tv_nsec == sb.st_mtim.tv_nsec) {
+		dump->last_use = ++d->tick;
+		return dump;
+	}
+
+	if (!dump) {
+		// A free slot, else the least recently used one
+		dump = &d->dumps[0];
+		for (int i = 0; i < DMN_DUMPS_MAX && dump->lubi_priv; i++)
+			if (!d->dumps[i].lubi_priv ||
+			    d->dumps[i].last_use < dump->last_use)
+				dump = &d->dumps[i];
+	}
+	dmn_dump_close(d, dump);
+
+	if (dmn_dump_open(d, dump, req, &sb))
+		return NULL;
+	dump->last_use = ++d->tick;
+
+	return dump;
+}
+
+/*
+ * Requests
+ */
+static void dmn_list(struct dmn *d, int fd, const struct dmn_req *req)
+{
+	struct dmn_dump *dump = dmn_dump_get(d, req);
+	struct lubi_vol_info info;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (!dump) {
+		dmn_reply_err(fd, "attach failed");
+		return;
+	}
+	if (!(f = open_memstream(&body, &len))) {
+		dmn_reply_err(fd, "out of memory");
+		return;
+	}
+	for (int vol_id = 0;
+	     !lubi_get_vol_info(dump->lubi_priv, vol_id, &info); vol_id++)
+		if (info.name)
+			fprintf(f, "%d %s %d %d %s\n", vol_id,
+				info.dynamic ? "dynamic" : "static",
+				info.reserved_lebs, info.leb_sz, info.name);
+	fclose(f);
+
+	dmn_reply(fd, body, len);
+	free(body);
+}
+
+/**
+ * Keeps each LEB as it is verified and copies what overlaps the range
+ * requested, stopping the read past the last LEB of interest
+ */
+static int dmn_leb(void *arg, const void *buf, unsigned int lnum, int len)
+{
+	struct dmn_rd *rd = arg;
+	long long start = (long long)lnum * rd->leb_sz;
+	long long from = start > rd->off ? start : rd->off;
+	long long to = start + len < rd->end ? start + len : rd->end;
+
+	dmn_leb_put(rd->d, rd->dump->gen, rd->vol_id, lnum, buf, len);
+	rd->lebs++;
+
+	if (from < to && buf)
+		memcpy(rd->out + from - rd->off, (const uint8_t *)buf + from - start,
+		       to - from);
+	else if (from < to)
+		memset(rd->out + from - rd->off, 0xFF, to - from);
+
+	// Not an error, the read is cut short
+	if (rd->last >= 0 && lnum >= rd->last) {
+		rd->stopped = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Serves [off, end) from the cached LEBs, if they are all there
+ */
+static int dmn_read_cached(struct dmn_rd *rd)
+{
+	struct dmn *d = rd->d;
+
+	if (rd->dump->vol_len[rd->vol_id] < 0)
+		return -1;
+
+	for (long long lnum = rd->off / rd->leb_sz;
+	     lnum * rd->leb_sz < rd->end; lnum++)
+		if (!dmn_leb_find(d, rd->dump->gen, rd->vol_id, lnum))
+			return -1;
+
+	for (long long lnum = rd->off / rd->leb_sz;
+	     lnum * rd->leb_sz < rd->end; lnum++) {
+		const struct dmn_leb *leb = dmn_leb_find(d, rd->dump->gen,
+							 rd->vol_id, lnum);
+		long long start = lnum * rd->leb_sz;
+		long long from = start > rd->off ? start : rd->off;
+		long long to = start + leb->len < rd->end ?
+			       start + leb->len : rd->end;
+
+		if (leb->buf)
+			memcpy(rd->out + from - rd->off,
+			       leb->buf + from - start, to - from);
+		else
+			memset(rd->out + from - rd->off, 0xFF, to - from);
+	}
+	return 0;
+}
+
+static void dmn_read(struct dmn *d, int fd, const struct dmn_req *req)
+{
+	struct dmn_dump *dump = dmn_dump_get(d, req);
+	struct dmn_rd rd = { .d = d, .dump = dump, .last = -1 };
+	struct lubi_vol_info info;
+	long long vol_len, cap;
+	int upd_marker, cached;
+
+	if (!dump) {
+		dmn_reply_err(fd, "attach failed");
+		return;
+	}
+	rd.vol_id = lubi_get_vol_id(dump->lubi_priv, req->vol, &upd_marker);
+	if (rd.vol_id < 0 || rd.vol_id >= DMN_VOLS_MAX ||
+	    lubi_get_vol_info(dump->lubi_priv, rd.vol_id, &info)) {
+		dmn_reply_err(fd, "no such volume");
+		return;
+	}
+
+	// Until the volume was read to its end, only an upper bound
+	vol_len = dump->vol_len[rd.vol_id];
+	cap = vol_len >= 0 ? vol_len : (long long)info.reserved_lebs * info.leb_sz;
+	rd.leb_sz = info.leb_sz;
+	rd.off = req->offset;
+	rd.end = req->len < 0 || req->len > cap - rd.off ? cap :
+		 rd.off + req->len;
+	if (rd.off < 0 || rd.off > cap || !rd.leb_sz) {
+		dmn_reply_err(fd, "bad range");
+		return;
+	}
+	if (!(rd.out = malloc(rd.end - rd.off + 1))) {
+		dmn_reply_err(fd, "out of memory");
+		return;
+	}
+
+	cached = !dmn_read_cached(&rd);
+	if (!cached) {
+		int len;
+
+		if (vol_len >= 0 && rd.end > rd.off)
+			rd.last = (rd.end - 1) / rd.leb_sz;
+		len = lubi_stream_vol(dump->lubi_priv, rd.vol_id,
+				      dump->peb_nb - 1, dmn_leb, &rd);
+		if (len < 0 && !rd.stopped) {
+			dmn_reply_err(fd, "volume read failed");
+			free(rd.out);
+			return;
+		}
+		if (!rd.stopped) {
+			dump->vol_len[rd.vol_id] = len;
+			if (rd.off > len) {
+				dmn_reply_err(fd, "bad range");
+				free(rd.out);
+				return;
+			}
+			if (rd.end > len)
+				rd.end = len;
+		}
+	}
+
+	fprintf(stderr, "%s: \"%s\" [%lld, %lld): %s (%d LEBs read, %lld "
+		"bytes cached)\n", dump->path, req->vol, rd.off, rd.end,
+		cached ? "cached" : "read", rd.lebs, d->cached);
+
+	dmn_reply(fd, rd.out, rd.end - rd.off);
+	free(rd.out);
+}
+
+/**
+ * Checks the geometry of a request, as sent by any client, before it is
+ * used, e.g. peb_sz to divide the dump size
+ */
+static int dmn_req_ok(const struct dmn_req *req)
+{
+	return req->peb_sz > 0 && req->peb_min >= 0 && req->peb_nb >= 0;
+}
+
+static void dmn_handle(struct dmn *d, int fd)
+{
+	char line[DMN_REQ_MAX], cmd[8], vol[256];
+	struct dmn_req req = { .len = -1 };
+	int n = 0;
+
+	if (read_line(fd, line, sizeof(line)) < 0) {
+		dmn_reply_err(fd, "bad request");
+		return;
+	}
+
+	if (sscanf(line, "%7s", cmd) != 1) {
+		dmn_reply_err(fd, "bad request");
+	} else if (!strcmp(cmd, "LIST") &&
+		   sscanf(line, "LIST %d %d %d %n", &req.peb_sz, &req.peb_min,
+			  &req.peb_nb, &n) == 3 && n && line[n] &&
+		   dmn_req_ok(&req)) {
+		req.path = &line[n];
+		dmn_list(d, fd, &req);
+	} else if (!strcmp(cmd, "READ") &&
+		   sscanf(line, "READ %d %d %d %lld %lld %255s %n",
+			  &req.peb_sz, &req.peb_min, &req.peb_nb, &req.offset,
+			  &req.len, vol, &n) == 6 && n && line[n] &&
+		   dmn_req_ok(&req)) {
+		req.path = &line[n];
+		req.vol = vol;
+		dmn_read(d, fd, &req);
+	} else {
+		dmn_reply_err(fd, "bad request");
+	}
+}
+
+/**
+ * Serves requests on the Unix socket sock_path, one at a time, forever
+ */
+int dmn_serve(const char *sock_path, const struct dmn_opts *opts)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct dmn *d;
+	int fd;
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		errx(-1, "Socket path too long: %s", sock_path);
+	strcpy(addr.sun_path, sock_path);
+
+	if (!(d = calloc(1, sizeof(*d))))
+		err(-1, "calloc");
+	d->opts = opts;
+
+	// Clients going away must not take the daemon down
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(-1, "socket");
+	unlink(sock_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 16))
+		err(-1, "%s", sock_path);
+	fprintf(stderr, "serving on %s (%lld MB of LEBs)\n", sock_path,
+		opts->cache_sz >> 20);
+
+	for (;;) {
+		int c = accept(fd, NULL, NULL);
+
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(-1, "accept");
+		}
+		dmn_handle(d, c);
+		close(c);
+	}
+
+	return 0;
+}
+
+/**
+ * Sends req to the daemon at sock_path and writes its answer to opath
+ */
+int dmn_client(const char *sock_path, const struct dmn_req *req,
+	       const char *opath)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char line[DMN_REQ_MAX], path[PATH_MAX], buf[1 << 16];
+	long long len;
+	int fd, out, n;
+
+	// The daemon may run from elsewhere
+	if (!realpath(req->path, path))
+		err(-1, "%s", req->path);
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		errx(-1, "Socket path too long: %s", sock_path);
+	strcpy(addr.sun_path, sock_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(-1, "socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		err(-1, "%s", sock_path);
+
+	if (req->vol)
+		n = snprintf(line, sizeof(line), "READ %d %d %d %lld %lld %s %s\n",
+			     req->peb_sz, req->peb_min, req->peb_nb,
+			     req->offset, req->len, req->vol, path);
+	else
+		n = snprintf(line, sizeof(line), "LIST %d %d %d %s\n",
+			     req->peb_sz, req->peb_min, req->peb_nb, path);
+	if (n >= (int)sizeof(line) || write_all(fd, line, n))
+		errx(-1, "Request failed");
+
+	if (read_line(fd, line, sizeof(line)) < 0)
+		errx(-1, "No answer from %s", sock_path);
+	if (sscanf(line, "OK %lld", &len) != 1) {
+		fprintf(stderr, "%s\n", line);
+		close(fd);
+		return -1;
+	}
+
+	if (!strcmp(opath, "-"))
+		out = fileno(stdout);
+	else if ((out = open(opath, O_WRONLY | O_TRUNC | O_CREAT, 0644)) < 0)
+		err(-1, "%s", opath);
+
+	while (len > 0) {
+		ssize_t ret = read(fd, buf, len < (long long)sizeof(buf) ?
+				   len : (long long)sizeof(buf));
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			errx(-1, "Short answer from %s", sock_path);
+		if (write_all(out, buf, ret))
+			err(-1, "write");
+		len -= ret;
+	}
+
+	if (out != fileno(stdout))
+		close(out);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Daemon mode of the example program
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+struct dmn_opts {
+	int io;				// FIO_*
+	int qd;
+	long long cache_sz;		// bytes of verified LEBs kept
+};
+
+struct dmn_req {
+	const char *path;		// dump
+	int peb_sz;
+	int peb_min;
+	int peb_nb;			// 0 for the whole dump
+	const char *vol;		// NULL to list the volumes
+	long long offset;
+	long long len;			// -1 up to the end of the volume
+};
+
+int dmn_serve(const char *sock_path, const struct dmn_opts *opts);
+int dmn_client(const char *sock_path, const struct dmn_req *req,
+	       const char *opath);
+
+#endif /* !__DAEMON_H__ */
@@ -0,0 +1,751 @@
+/*
+ * Decoders of the example program: LZ4 (frame and legacy formats) and
+ * LZMA (.lzma, as produced by mkimage -C lzma), self-contained
+ *
+ * They pull their input chunk by chunk, e.g. as the LEBs are read, so that
+ * a volume can be decompressed while it is extracted; a uImage header is
+ * skipped, the image data bounding the input
+ *
+ * The volume data CRCs already cover the compressed stream, the optional
+ * LZ4 checksums are not checked
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decomp.h"
+
+#define LZ4_MAGIC		0x184D2204
+#define LZ4_LEGACY_MAGIC	0x184C2102
+#define LZ4_SKIP_MAGIC		0x184D2A50	// & 0xFFFFFFF0
+#define LZ4_LEGACY_BLOCK	(8 << 20)
+#define LZ4_HIST		(64 << 10)
+
+#define IH_MAGIC		0x27051956
+#define IH_SZ			64
+
+struct dec_rd {
+	const struct dec_io *io;
+	const uint8_t *p, *end;
+	size_t left;			// bytes of input allowed
+	int eof;
+};
+
+static int rd_fill(struct dec_rd *rd)
+{
+	size_t len = 0;
+
+	if (!rd->eof && rd->left)
+		rd->p = rd->io->in(rd->io->arg, &len);
+	if (!len) {
+		rd->eof = 1;
+		return -1;
+	}
+	if (len > rd->left)
+		len = rd->left;
+	rd->left -= len;
+	rd->end = rd->p + len;
+
+	return 0;
+}
+
+/**
+ * Returns the next input byte, -1 at the end
+ */
+static inline int rd_byte(struct dec_rd *rd)
+{
+	if (rd->p == rd->end && rd_fill(rd))
+		return -1;
+	return *rd->p++;
+}
+
+static int rd_bytes(struct dec_rd *rd, void *dst, size_t len)
+{
+	uint8_t *d = dst;
+
+	while (len) {
+		size_t n;
+
+		if (rd->p == rd->end && rd_fill(rd))
+			return -1;
+		n = rd->end - rd->p < (ptrdiff_t)len ? (size_t)(rd->end - rd->p) :
+						       len;
+		if (d)
+			memcpy(d, rd->p, n);
+		rd->p += n;
+		len -= n;
+		if (d)
+			d += n;
+	}
+	return 0;
+}
+
+static int rd_le32(struct dec_rd *rd, uint32_t *v)
+{
+	uint8_t b[4];
+
+	if (rd_bytes(rd, b, 4))
+		return -1;
+	*v = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+	return 0;
+}
+
+/*
+ * LZ4
+ */
+
+/**
+ * Decodes the block src[0..len) at dst, the history being what precedes
+ * dst from base on, returns the decoded size or -1
+ */
+static long lz4_block(const uint8_t *src, size_t len, uint8_t *base,
+		      uint8_t *dst, size_t room)
+{
+	const uint8_t *ip = src, *iend = src + len;
+	uint8_t *op = dst, *oend = dst + room;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit = token >> 4, ml = token & 15, off;
+		const uint8_t *match;
+
+		if (lit == 15) {
+			unsigned int b;
+
+			do {
+				if (ip == iend)
+					return -1;
+				lit += b = *ip++;
+			} while (b == 255);
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!off || off > (size_t)(op - base))
+			return -1;
+
+		if (ml == 15) {
+			unsigned int b;
+
+			do {
+				if (ip == iend)
+					return -1;
+				ml += b = *ip++;
+			} while (b == 255);
+		}
+		ml += 4;
+		if (ml > (size_t)(oend - op))
+			return -1;
+
+		match = op - off;
+		if (off >= ml) {
+			memcpy(op, match, ml);
+			op += ml;
+		} else {
+			// Overlapping, e.g. a run
+			while (ml--)
+				*op++ = *match++;
+		}
+	}
+	return op - dst;
+}
+
+/**
+ * Reads the blocks of a frame, or of a legacy stream if bmax is
+ * LZ4_LEGACY_BLOCK, the blocks of linked frames being decoded after the
+ * last 64KB of output
+ */
+static int lz4_blocks(struct dec_rd *rd, const struct dec_io *io,
+		      size_t bmax, int linked, int block_crc)
+{
+	int legacy = bmax == LZ4_LEGACY_BLOCK;
+	// Worst case expansion of an incompressible block
+	size_t cmax = bmax + bmax / 255 + 16;
+	uint8_t *src = malloc(cmax), *buf = malloc(LZ4_HIST + bmax);
+	size_t hist = 0;
+	int ret = -1, blocks = 0;
+
+	if (!src || !buf)
+		goto out;
+
+	for (;;) {
+		uint32_t bsz;
+		int raw;
+		long n;
+
+		if (rd_le32(rd, &bsz)) {
+			// Legacy streams just end
+			ret = legacy && rd->eof ? 0 : -1;
+			break;
+		}
+		if (legacy && bsz == LZ4_LEGACY_MAGIC)
+			continue;
+		// Nor have they an end mark: what follows the last block, e.g.
+		// 0xFF padding, can't be taken for a block
+		if (legacy && blocks && (!bsz || bsz > cmax)) {
+			ret = 0;
+			break;
+		}
+		if (!legacy && !bsz) {
+			ret = 0;
+			break;
+		}
+
+		raw = !legacy && bsz & 0x80000000;
+		bsz &= ~0x80000000;
+		if (bsz > (raw ? bmax : cmax) || rd_bytes(rd, src, bsz) ||
+		    (block_crc && rd_bytes(rd, NULL, 4)))
+			break;
+
+		if (!linked)
+			hist = 0;
+		if (raw) {
+			memcpy(buf + hist, src, bsz);
+			n = bsz;
+		} else {
+			n = lz4_block(src, bsz, buf, buf + hist, bmax);
+			if (n < 0)
+				break;
+		}
+		if (io->out(io->arg, buf + hist, n))
+			break;
+		blocks++;
+
+		if (!linked)
+			continue;
+		if (hist + n > LZ4_HIST) {
+			memmove(buf, buf + hist + n - LZ4_HIST, LZ4_HIST);
+			hist = LZ4_HIST;
+		} else {
+			hist += n;
+		}
+	}
+out:
+	free(src);
+	free(buf);
+
+	return ret;
+}
+
+static int lz4_dec(struct dec_rd *rd, const struct dec_io *io)
+{
+	uint32_t magic;
+	uint8_t desc[2];
+
+	for (;;) {
+		uint32_t len;
+
+		if (rd_le32(rd, &magic))
+			return -1;
+		if ((magic & 0xFFFFFFF0) != LZ4_SKIP_MAGIC)
+			break;
+		if (rd_le32(rd, &len) || rd_bytes(rd, NULL, len))
+			return -1;
+	}
+
+	if (magic == LZ4_LEGACY_MAGIC)
+		return lz4_blocks(rd, io, LZ4_LEGACY_BLOCK, 0, 0);
+	if (magic != LZ4_MAGIC || rd_bytes(rd, desc, 2))
+		return -1;
+
+	// FLG: version 01, block independence, block checksum, content size,
+	// content checksum, dict ID - BD: block max size
+	if ((desc[0] & 0xC0) != 0x40 || (desc[1] >> 4 & 7) < 4 ||
+	    rd_bytes(rd, NULL, (desc[0] & 0x08 ? 8 : 0) +
+			      (desc[0] & 0x01 ? 4 : 0) + 1))
+		return -1;
+
+	if (lz4_blocks(rd, io, 1 << (8 + 2 * (desc[1] >> 4 & 7)),
+		       !(desc[0] & 0x20), desc[0] & 0x10))
+		return -1;
+
+	return desc[0] & 0x04 ? rd_bytes(rd, NULL, 4) : 0;
+}
+
+/*
+ * LZMA, after the LZMA SDK specification (lzma-specification.txt)
+ */
+
+#define LZMA_PROB_BITS		11
+#define LZMA_PROB_INIT		(1 << LZMA_PROB_BITS >> 1)
+#define LZMA_MOVE_BITS		5
+#define LZMA_TOP		(1 << 24)
+#define LZMA_STATES		12
+#define LZMA_POS_BITS_MAX	4
+#define LZMA_LEN_TO_POS		4
+#define LZMA_END_POS_MODEL	14
+#define LZMA_FULL_DISTANCES	(1 << (LZMA_END_POS_MODEL >> 1))
+#define LZMA_ALIGN_BITS		4
+#define LZMA_MIN_WINDOW		(1 << 12)
+
+typedef uint16_t prob_t;
+
+struct lzma_len {
+	prob_t choice, choice2;
+	prob_t low[1 << LZMA_POS_BITS_MAX][1 << 3];
+	prob_t mid[1 << LZMA_POS_BITS_MAX][1 << 3];
+	prob_t high[1 << 8];
+};
+
+struct lzma {
+	struct dec_rd *rd;
+	const struct dec_io *io;
+	uint32_t range, code;
+	int corrupted;
+
+	// Output window, flushed when it wraps
+	uint8_t *win;
+	uint32_t win_sz, pos, flushed;
+	int full;
+	uint64_t total;
+
+	unsigned int lc, lp, pb;
+	uint32_t dict_sz;
+	prob_t *lit;
+	prob_t pos_slot[LZMA_LEN_TO_POS][1 << 6];
+	prob_t pos_dec[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_MODEL];
+	prob_t align[1 << LZMA_ALIGN_BITS];
+	prob_t is_match[LZMA_STATES << LZMA_POS_BITS_MAX];
+	prob_t is_rep[LZMA_STATES];
+	prob_t is_rep_g0[LZMA_STATES];
+	prob_t is_rep_g1[LZMA_STATES];
+	prob_t is_rep_g2[LZMA_STATES];
+	prob_t is_rep0_long[LZMA_STATES << LZMA_POS_BITS_MAX];
+	struct lzma_len len_dec, rep_len_dec;
+};
+
+static inline uint32_t rc_byte(struct lzma *lz)
+{
+	int b = rd_byte(lz->rd);
+
+	if (b < 0) {
+		lz->corrupted = 1;
+		return 0;
+	}
+	return b;
+}
+
+static inline void rc_normalize(struct lzma *lz)
+{
+	if (lz->range < LZMA_TOP) {
+		lz->range <<= 8;
+		lz->code = lz->code << 8 | rc_byte(lz);
+	}
+}
+
+static inline unsigned int rc_bit(struct lzma *lz, prob_t *p)
+{
+	uint32_t v = *p, bound = (lz->range >> LZMA_PROB_BITS) * v;
+	unsigned int bit;
+
+	if (lz->code < bound) {
+		v += ((1 << LZMA_PROB_BITS) - v) >> LZMA_MOVE_BITS;
+		lz->range = bound;
+		bit = 0;
+	} else {
+		v -= v >> LZMA_MOVE_BITS;
+		lz->code -= bound;
+		lz->range -= bound;
+		bit = 1;
+	}
+	*p = v;
+	rc_normalize(lz);
+
+	return bit;
+}
+
+static uint32_t rc_direct(struct lzma *lz, int bits)
+{
+	uint32_t res = 0;
+
+	do {
+		uint32_t t;
+
+		lz->range >>= 1;
+		lz->code -= lz->range;
+		t = 0 - (lz->code >> 31);
+		lz->code += lz->range & t;
+		if (lz->code == lz->range)
+			lz->corrupted = 1;
+		rc_normalize(lz);
+		res = (res << 1) + (t + 1);
+	} while (--bits);
+
+	return res;
+}
+
+static unsigned int bittree(struct lzma *lz, prob_t *probs, int bits)
+{
+	unsigned int m = 1;
+
+	for (int i = 0; i < bits; i++)
+		m = (m << 1) + rc_bit(lz, &probs[m]);
+	return m - (1u << bits);
+}
+
+static unsigned int bittree_rev(struct lzma *lz, prob_t *probs, int bits)
+{
+	unsigned int m = 1, sym = 0;
+
+	for (int i = 0; i < bits; i++) {
+		unsigned int bit = rc_bit(lz, &probs[m]);
+
+		m = (m << 1) + bit;
+		sym |= bit << i;
+	}
+	return sym;
+}
+
+static unsigned int lzma_len(struct lzma *lz, struct lzma_len *ld,
+			     unsigned int pos_state)
+{
+	if (!rc_bit(lz, &ld->choice))
+		return bittree(lz, ld->low[pos_state], 3);
+	if (!rc_bit(lz, &ld->choice2))
+		return 8 + bittree(lz, ld->mid[pos_state], 3);
+	return 16 + bittree(lz, ld->high, 8);
+}
+
+static int win_flush(struct lzma *lz)
+{
+	int ret = lz->io->out(lz->io->arg, lz->win + lz->flushed,
+			      lz->pos - lz->flushed);
+
+	lz->flushed = lz->pos;
+	return ret;
+}
+
+static int win_wrap(struct lzma *lz)
+{
+	lz->full = 1;
+	if (win_flush(lz))
+		return -1;
+	lz->pos = lz->flushed = 0;
+	return 0;
+}
+
+static inline int win_put(struct lzma *lz, uint8_t b)
+{
+	lz->total++;
+	lz->win[lz->pos++] = b;
+	return lz->pos == lz->win_sz ? win_wrap(lz) : 0;
+}
+
+static inline uint8_t win_get(const struct lzma *lz, uint32_t dist)
+{
+	return lz->win[dist <= lz->pos ? lz->pos - dist :
+			lz->win_sz - dist + lz->pos];
+}
+
+/**
+ * Copies len bytes from dist back, in runs up to the end of the window
+ */
+static int win_copy(struct lzma *lz, uint32_t dist, uint32_t len)
+{
+	while (len) {
+		uint32_t src = dist <= lz->pos ? lz->pos - dist :
+			       lz->win_sz - dist + lz->pos;
+		uint32_t n = len;
+
+		if (n > lz->win_sz - lz->pos)
+			n = lz->win_sz - lz->pos;
+		if (n > lz->win_sz - src)
+			n = lz->win_sz - src;
+
+		if (dist >= n) {
+			memmove(lz->win + lz->pos, lz->win + src, n);
+		} else {
+			// Overlapping, e.g. a run
+			for (uint32_t i = 0; i < n; i++)
+				lz->win[lz->pos + i] = lz->win[src + i];
+		}
+		lz->pos += n;
+		lz->total += n;
+		len -= n;
+
+		if (lz->pos == lz->win_sz && win_wrap(lz))
+			return -1;
+	}
+	return 0;
+}
+
+static int lzma_literal(struct lzma *lz, unsigned int state, uint32_t rep0)
+{
+	unsigned int prev = lz->full || lz->pos ? win_get(lz, 1) : 0;
+	unsigned int sym = 1, lit_state;
+	prob_t *probs;
+
+	lit_state = ((lz->total & ((1u << lz->lp) - 1)) << lz->lc) +
+		    (prev >> (8 - lz->lc));
+	probs = &lz->lit[0x300 * lit_state];
+
+	if (state >= 7) {
+		unsigned int match = win_get(lz, rep0 + 1);
+
+		do {
+			unsigned int mbit = (match >> 7) & 1;
+			unsigned int bit;
+
+			match <<= 1;
+			bit = rc_bit(lz, &probs[((1 + mbit) << 8) + sym]);
+			sym = sym << 1 | bit;
+			if (mbit != bit)
+				break;
+		} while (sym < 0x100);
+	}
+	while (sym < 0x100)
+		sym = sym << 1 | rc_bit(lz, &probs[sym]);
+
+	return win_put(lz, sym - 0x100);
+}
+
+static uint32_t lzma_dist(struct lzma *lz, unsigned int len)
+{
+	unsigned int slot, bits;
+	uint32_t dist;
+
+	slot = bittree(lz, lz->pos_slot[len < LZMA_LEN_TO_POS - 1 ?
+					len : LZMA_LEN_TO_POS - 1], 6);
+	if (slot < 4)
+		return slot;
+
+	bits = (slot >> 1) - 1;
+	dist = (2 | (slot & 1)) << bits;
+	if (slot < LZMA_END_POS_MODEL)
+		return dist + bittree_rev(lz, lz->pos_dec + dist - slot, bits);
+
+	dist += rc_direct(lz, bits - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+	return dist + bittree_rev(lz, lz->align, LZMA_ALIGN_BITS);
+}
+
+static void lzma_probs(prob_t *p, size_t nb)
+{
+	while (nb--)
+		*p++ = LZMA_PROB_INIT;
+}
+
+/**
+ * Decodes the stream after its 13 bytes header, returns 0 once the
+ * announced size or the end marker is reached
+ */
+static int lzma_run(struct lzma *lz, uint64_t size, int sized)
+{
+	uint32_t rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+	unsigned int state = 0;
+
+	lz->range = 0xFFFFFFFF;
+	lz->code = 0;
+	if (rc_byte(lz))
+		return -1;
+	for (int i = 0; i < 4; i++)
+		lz->code = lz->code << 8 | rc_byte(lz);
+	if (lz->code == lz->range)
+		return -1;
+
+	for (;;) {
+		unsigned int pos_state = lz->total & ((1u << lz->pb) - 1);
+		unsigned int len;
+
+		if (lz->corrupted)
+			return -1;
+		// The end marker is optional then
+		if (sized && !size && !lz->code)
+			return 0;
+
+		if (!rc_bit(lz, &lz->is_match[(state << LZMA_POS_BITS_MAX) +
+					      pos_state])) {
+			if (sized && !size)
+				return -1;
+			if (lzma_literal(lz, state, rep0))
+				return -1;
+			state = state < 4 ? 0 : state < 10 ? state - 3 :
+				state - 6;
+			size--;
+			continue;
+		}
+
+		if (rc_bit(lz, &lz->is_rep[state])) {
+			if ((sized && !size) || (!lz->full && !lz->pos))
+				return -1;
+			if (!rc_bit(lz, &lz->is_rep_g0[state])) {
+				if (!rc_bit(lz, &lz->is_rep0_long[(state << LZMA_POS_BITS_MAX) +
+								 pos_state])) {
+					// Short rep
+					state = state < 7 ? 9 : 11;
+					if (win_put(lz, win_get(lz, rep0 + 1)))
+						return -1;
+					size--;
+					continue;
+				}
+			} else {
+				uint32_t dist;
+
+				if (!rc_bit(lz, &lz->is_rep_g1[state])) {
+					dist = rep1;
+				} else {
+					if (!rc_bit(lz, &lz->is_rep_g2[state])) {
+						dist = rep2;
+					} else {
+						dist = rep3;
+						rep3 = rep2;
+					}
+					rep2 = rep1;
+				}
+				rep1 = rep0;
+				rep0 = dist;
+			}
+			len = lzma_len(lz, &lz->rep_len_dec, pos_state);
+			state = state < 7 ? 8 : 11;
+		} else {
+			rep3 = rep2;
+			rep2 = rep1;
+			rep1 = rep0;
+			len = lzma_len(lz, &lz->len_dec, pos_state);
+			state = state < 7 ? 7 : 10;
+			rep0 = lzma_dist(lz, len);
+			if (rep0 == 0xFFFFFFFF)
+				return lz->code || lz->corrupted ? -1 : 0;
+			if ((sized && !size) || rep0 >= lz->dict_sz ||
+			    (!lz->full && rep0 >= lz->pos))
+				return -1;
+		}
+
+		len += 2;
+		if (sized && size < len)
+			return -1;
+		size -= len;
+		if (win_copy(lz, rep0 + 1, len))
+			return -1;
+	}
+}
+
+static int lzma_dec(struct dec_rd *rd, const struct dec_io *io)
+{
+	struct lzma *lz;
+	uint8_t hdr[13];
+	uint64_t size = 0;
+	unsigned int d;
+	int ret = -1;
+
+	if (rd_bytes(rd, hdr, sizeof(hdr)) || hdr[0] >= 9 * 5 * 5)
+		return -1;
+	if (!(lz = calloc(1, sizeof(*lz))))
+		return -1;
+
+	d = hdr[0];
+	lz->lc = d % 9;
+	d /= 9;
+	lz->lp = d % 5;
+	lz->pb = d / 5;
+	lz->dict_sz = hdr[1] | hdr[2] << 8 | hdr[3] << 16 |
+		      (uint32_t)hdr[4] << 24;
+	for (int i = 0; i < 8; i++)
+		size |= (uint64_t)hdr[5 + i] << (8 * i);
+
+	// No need for a window larger than the output
+	lz->win_sz = lz->dict_sz;
+	if (size != UINT64_MAX && size < lz->win_sz)
+		lz->win_sz = size;
+	if (lz->win_sz < LZMA_MIN_WINDOW)
+		lz->win_sz = LZMA_MIN_WINDOW;
+
+	lz->rd = rd;
+	lz->io = io;
+	lz->win = malloc(lz->win_sz);
+	lz->lit = malloc(sizeof(prob_t) * (0x300u << (lz->lc + lz->lp)));
+	if (!lz->win || !lz->lit)
+		goto out;
+
+	lzma_probs(lz->lit, 0x300u << (lz->lc + lz->lp));
+	lzma_probs(&lz->pos_slot[0][0], sizeof(lz->pos_slot) / sizeof(prob_t));
+	lzma_probs(lz->pos_dec, sizeof(lz->pos_dec) / sizeof(prob_t));
+	lzma_probs(lz->align, sizeof(lz->align) / sizeof(prob_t));
+	lzma_probs(lz->is_match, sizeof(lz->is_match) / sizeof(prob_t));
+	lzma_probs(lz->is_rep, sizeof(lz->is_rep) / sizeof(prob_t));
+	lzma_probs(lz->is_rep_g0, sizeof(lz->is_rep_g0) / sizeof(prob_t));
+	lzma_probs(lz->is_rep_g1, sizeof(lz->is_rep_g1) / sizeof(prob_t));
+	lzma_probs(lz->is_rep_g2, sizeof(lz->is_rep_g2) / sizeof(prob_t));
+	lzma_probs(lz->is_rep0_long, sizeof(lz->is_rep0_long) / sizeof(prob_t));
+	lzma_probs(&lz->len_dec.choice, sizeof(lz->len_dec) / sizeof(prob_t));
+	lzma_probs(&lz->rep_len_dec.choice,
+		   sizeof(lz->rep_len_dec) / sizeof(prob_t));
+
+	if (!lzma_run(lz, size, size != UINT64_MAX))
+		ret = win_flush(lz);
+out:
+	free(lz->win);
+	free(lz->lit);
+	free(lz);
+
+	return ret;
+}
+
+/*
+ *
+ */
+
+int dec_type(const char *name)
+{
+	if (!strcmp(name, "lz4"))
+		return DEC_LZ4;
+	if (!strcmp(name, "lzma"))
+		return DEC_LZMA;
+	return -1;
+}
+
+const char *dec_name(int type)
+{
+	return type == DEC_LZ4 ? "lz4" : type == DEC_LZMA ? "lzma" : "none";
+}
+
+/**
+ * Decodes the whole input, returns -1 on corrupted or truncated data or if
+ * io->out fails; what follows the compressed stream is ignored
+ */
+int dec_run(int type, const struct dec_io *io)
+{
+	struct dec_rd rd = { .io = io, .left = SIZE_MAX };
+	const uint8_t *ih;
+	size_t have;
+
+	// Sniff a uImage header, as the SPL glue expects
+	if (rd_fill(&rd))
+		return -1;
+	ih = rd.p;
+	have = rd.end - rd.p;
+	if (have >= IH_SZ && ((uint32_t)ih[0] << 24 | ih[1] << 16 |
+			      ih[2] << 8 | ih[3]) == IH_MAGIC) {
+		// ih_size, the data following the header
+		rd.left = (uint32_t)ih[12] << 24 | ih[13] << 16 | ih[14] << 8 |
+			  ih[15];
+		rd.p += IH_SZ;
+		have -= IH_SZ;
+		if (have > rd.left) {
+			rd.end = rd.p + rd.left;
+			rd.left = 0;
+		} else {
+			rd.left -= have;
+		}
+	}
+
+	switch (type) {
+	case DEC_LZ4:
+		return lz4_dec(&rd, io);
+	case DEC_LZMA:
+		return lzma_dec(&rd, io);
+	}
+	return -1;
+}
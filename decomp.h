@@ -0,0 +1,29 @@
+/*
+ * Decoders of the example program
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef __DECOMP_H__
+#define __DECOMP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	DEC_NONE,
+	DEC_LZ4,
+	DEC_LZMA,
+};
+
+// The input is pulled chunk by chunk, the output pushed as it is decoded
+struct dec_io {
+	const uint8_t *(*in)(void *arg, size_t *len);	// len 0 at the end
+	int (*out)(void *arg, const void *buf, size_t len);
+	void *arg;
+};
+
+int dec_type(const char *name);
+const char *dec_name(int type);
+int dec_run(int type, const struct dec_io *io);
+
+#endif /* !__DECOMP_H__ */
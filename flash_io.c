@@ -0,0 +1,597 @@
+/*
+ * Input backends of the example program: mmap, pread and io_uring
+ *
+ * The io_uring backend keeps the reads announced by lubi_set_prefetch()
+ * in flight, up to qd of them, and serves flash_read from them, falling
+ * back to pread for the reads that were not announced
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <err.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "flash_io.h"
+
+#define REQ(fio, n)	(&(fio)->reqs[(n) % (fio)->reqs_nb])
+#define FIO_IOV_MAX	64
+
+enum {
+	REQ_PENDING,
+	REQ_INFLIGHT,
+	REQ_DONE,
+};
+
+/**
+ * Reads len bytes at off, what lies past the end of the file reads as
+ * erased flash
+ */
+static int pread_full(int fd, void *dst, int len, off_t off)
+{
+	uint8_t *p = dst;
+	int left = len;
+
+	while (left) {
+		ssize_t r = pread(fd, p, left, off);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		p += r;
+		off += r;
+		left -= r;
+	}
+	memset(p, 0xFF, left);
+	return len;
+}
+
+/**
+ * Offset in the dump of byte offset of PEB pnum, past the OOB areas of the
+ * pages before it
+ */
+static off_t fio_off(const struct fio *fio, int pnum, int offset)
+{
+	off_t off = (off_t)pnum * fio->peb_stride;
+
+	if (!fio->oob_sz)
+		return off + offset;
+
+	return off + (off_t)(offset / fio->oob_page_sz) *
+	       (fio->oob_page_sz + fio->oob_sz) + offset % fio->oob_page_sz;
+}
+
+/**
+ * Number of bytes of the dump holding len bytes from offset on
+ */
+static int fio_span(const struct fio *fio, int offset, int len)
+{
+	return fio_off(fio, 0, offset + len - 1) + 1 - fio_off(fio, 0, offset);
+}
+
+/**
+ * Copies len bytes to dst from src, which holds the dump from offset on,
+ * skipping the OOB areas
+ */
+static void fio_gather(const struct fio *fio, void *dst, const uint8_t *src,
+		       int offset, int len)
+{
+	uint8_t *p = dst;
+
+	if (!fio->oob_sz) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	while (len) {
+		int head = offset % fio->oob_page_sz;
+		int chunk = fio->oob_page_sz - head < len ?
+			    fio->oob_page_sz - head : len;
+
+		memcpy(p, src, chunk);
+		p += chunk;
+		src += chunk + fio->oob_sz;
+		offset += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * pread, with the OOB areas of interleaved dumps scattered to oob_scratch
+ */
+static int fio_pread(struct fio *fio, void *dst, int pnum, int offset, int len)
+{
+	uint8_t *p = dst;
+
+	if (!fio->oob_sz)
+		return pread_full(fio->fd, dst, len, fio_off(fio, pnum, offset));
+
+	while (len) {
+		struct iovec iov[FIO_IOV_MAX];
+		off_t off = fio_off(fio, pnum, offset);
+		int n = 0, chunk_len = 0;
+		ssize_t r, want = 0;
+
+		while (chunk_len < len && n < FIO_IOV_MAX - 1) {
+			int head = (offset + chunk_len) % fio->oob_page_sz;
+			int chunk = fio->oob_page_sz - head;
+
+			if (chunk > len - chunk_len)
+				chunk = len - chunk_len;
+			iov[n].iov_base = p + chunk_len;
+			iov[n++].iov_len = chunk;
+			chunk_len += chunk;
+			want += chunk;
+			if (chunk_len < len) {
+				iov[n].iov_base = fio->oob_scratch;
+				iov[n++].iov_len = fio->oob_sz;
+				want += fio->oob_sz;
+			}
+		}
+
+		do {
+			r = preadv(fio->fd, iov, n, off);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0)
+			return -1;
+
+		// Past the end of the file, reads as erased flash
+		if (r < want) {
+			int got = 0;
+
+			for (int i = 0; i < n && r > 0; i++) {
+				int take = r < (ssize_t)iov[i].iov_len ?
+					   (int)r : (int)iov[i].iov_len;
+
+				if (iov[i].iov_base != fio->oob_scratch)
+					got += take;
+				r -= take;
+			}
+			memset(p + got, 0xFF, len - got);
+			break;
+		}
+
+		p += chunk_len;
+		offset += chunk_len;
+		len -= chunk_len;
+	}
+	return p - (uint8_t *)dst;
+}
+
+/**
+ * Unmaps the rings of uring_setup() and closes the ring
+ */
+static void uring_teardown(struct fio *fio)
+{
+	if (fio->sq_ring)
+		munmap(fio->sq_ring, fio->sq_ring_sz);
+	if (fio->cq_ring)
+		munmap(fio->cq_ring, fio->cq_ring_sz);
+	if (fio->sqes)
+		munmap(fio->sqes, fio->sqes_sz);
+	fio->sq_ring = fio->cq_ring = NULL;
+	fio->sqes = NULL;
+	close(fio->ring_fd);
+}
+
+#ifdef HAVE_IO_URING
+static void *uring_map(struct fio *fio, size_t sz, off_t offs)
+{
+	void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fio->ring_fd, offs);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ *
+ */
+static int uring_setup(struct fio *fio, int qd)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	fio->ring_fd = syscall(__NR_io_uring_setup, qd, &p);
+	if (fio->ring_fd < 0)
+		return -1;
+
+	fio->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	fio->cq_ring_sz = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	fio->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	fio->sq_ring = sq = uring_map(fio, fio->sq_ring_sz, IORING_OFF_SQ_RING);
+	fio->cq_ring = cq = uring_map(fio, fio->cq_ring_sz, IORING_OFF_CQ_RING);
+	fio->sqes = uring_map(fio, fio->sqes_sz, IORING_OFF_SQES);
+	if (!sq || !cq || !fio->sqes) {
+		uring_teardown(fio);
+		return -1;
+	}
+
+	fio->sq_ktail = (unsigned int *)(sq + p.sq_off.tail);
+	fio->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	fio->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	fio->sq_tail = *fio->sq_ktail;
+	fio->cq_khead = (unsigned int *)(cq + p.cq_off.head);
+	fio->cq_ktail = (unsigned int *)(cq + p.cq_off.tail);
+	fio->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	fio->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	fio->to_submit = 0;
+
+	return 0;
+}
+
+/**
+ * Hands the queued SQEs to the kernel, and waits for min_complete CQEs
+ */
+static void uring_enter(struct fio *fio, unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, fio->ring_fd,
+			      fio->to_submit, min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		err(-1, "io_uring_enter");
+
+	if (fio->to_submit)
+		fio->stats.submits++;
+	fio->to_submit -= ret;
+}
+
+/**
+ *
+ */
+static void uring_reap(struct fio *fio)
+{
+	unsigned int head = *fio->cq_khead;
+	unsigned int tail = __atomic_load_n(fio->cq_ktail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &fio->cqes[head & fio->cq_mask];
+		struct fio_req *req = &fio->reqs[cqe->user_data];
+
+		req->res = cqe->res;
+		req->state = REQ_DONE;
+		fio->inflight--;
+	}
+	__atomic_store_n(fio->cq_khead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues SQEs for the pending reads, in order, as long as there is room
+ */
+static void uring_queue(struct fio *fio)
+{
+	for (; fio->queued != fio->tail && fio->inflight < fio->qd;
+	     fio->queued++) {
+		struct fio_req *req = REQ(fio, fio->queued);
+		unsigned int idx = fio->sq_tail & fio->sq_mask;
+		struct io_uring_sqe *sqe = &fio->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fio->fd;
+		sqe->off = fio_off(fio, req->pnum, req->offset);
+		sqe->addr = (uintptr_t)&req->iov;
+		sqe->len = 1;
+		sqe->user_data = req - fio->reqs;
+		fio->sq_array[idx] = idx;
+		fio->sq_tail++;
+		fio->to_submit++;
+
+		req->state = REQ_INFLIGHT;
+		fio->inflight++;
+	}
+	__atomic_store_n(fio->sq_ktail, fio->sq_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ *
+ */
+static void uring_wait(struct fio *fio, struct fio_req *req)
+{
+	while (req->state != REQ_DONE) {
+		uring_queue(fio);
+		uring_enter(fio, 1);
+		uring_reap(fio);
+	}
+}
+#else
+static int uring_setup(struct fio *fio, int qd)
+{
+	(void)fio;
+	(void)qd;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void uring_enter(struct fio *fio, unsigned int min_complete)
+{
+	(void)fio;
+	(void)min_complete;
+}
+
+static void uring_queue(struct fio *fio)
+{
+	(void)fio;
+}
+
+static void uring_wait(struct fio *fio, struct fio_req *req)
+{
+	(void)fio;
+	(void)req;
+}
+#endif
+
+/**
+ * Drops the oldest announced read, once the kernel is done with its buffer
+ */
+static void fio_retire(struct fio *fio)
+{
+	struct fio_req *req = REQ(fio, fio->head);
+
+	if (req->state == REQ_PENDING)
+		fio->queued++;
+	else
+		uring_wait(fio, req);
+	if (!req->used)
+		fio->stats.dropped++;
+	fio->head++;
+}
+
+/**
+ * With the io_uring backend, queues the read for it to be submitted along
+ * with the others at the next fio_read(), otherwise only lets the kernel
+ * know it is coming
+ */
+void fio_prefetch(struct fio *fio, int pnum, int offset, int len)
+{
+	struct fio_req *req;
+	int span;
+
+	if (fio->type == FIO_PREAD) {
+		posix_fadvise(fio->fd, fio_off(fio, pnum, offset),
+			      fio_span(fio, offset, len), POSIX_FADV_WILLNEED);
+		return;
+	}
+	if (fio->type != FIO_URING)
+		return;
+
+	// Cover whatever page-aligned reads flash_read may be called with
+	if (fio->page_sz) {
+		int head = offset % fio->page_sz;
+
+		offset -= head;
+		len = (head + len + fio->page_sz - 1) / fio->page_sz *
+		      fio->page_sz;
+	}
+
+	if (fio->tail - fio->head == (unsigned int)fio->reqs_nb)
+		fio_retire(fio);
+
+	span = fio_span(fio, offset, len);
+	req = REQ(fio, fio->tail);
+	if (req->buf_sz < span) {
+		free(req->buf);
+		if (!(req->buf = malloc(span)))
+			err(-1, "malloc");
+		req->buf_sz = span;
+	}
+	req->pnum = pnum;
+	req->offset = offset;
+	req->len = len;
+	req->state = REQ_PENDING;
+	req->used = 0;
+	req->iov.iov_base = req->buf;
+	req->iov.iov_len = span;
+	fio->tail++;
+
+	uring_queue(fio);
+}
+
+/**
+ *
+ */
+static int fio_read_uring(struct fio *fio, void *dst, int pnum, int offset,
+			  int len)
+{
+	struct fio_req *req = NULL;
+	unsigned int n;
+
+	for (n = fio->head; n != fio->tail; n++) {
+		struct fio_req *r = REQ(fio, n);
+
+		if (r->pnum == pnum && offset >= r->offset &&
+		    offset + len <= r->offset + r->len) {
+			req = r;
+			break;
+		}
+	}
+	if (!req) {
+		if (fio->to_submit)
+			uring_enter(fio, 0);
+		fio->stats.misses++;
+		return fio_pread(fio, dst, pnum, offset, len);
+	}
+
+	// The reads are consumed in the order they were announced, the ones
+	// skipped are not coming
+	while (fio->head != n)
+		fio_retire(fio);
+
+	uring_wait(fio, req);
+	uring_queue(fio);
+	if (fio->to_submit)
+		uring_enter(fio, 0);
+
+	if (req->res < 0) {
+		errno = -req->res;
+		return -1;
+	}
+	// Past the end of the file, reads as erased flash
+	if (req->res < (int)req->iov.iov_len) {
+		memset(req->buf + req->res, 0xFF, req->iov.iov_len - req->res);
+		req->res = req->iov.iov_len;
+	}
+	fio_gather(fio, dst, req->buf + (fio_off(fio, pnum, offset) -
+					 fio_off(fio, pnum, req->offset)),
+		   offset, len);
+
+	// Kept around for the other reads it covers
+	req->used = 1;
+	fio->stats.hits++;
+
+	return len;
+}
+
+/**
+ *
+ */
+int fio_read(struct fio *fio, void *dst, int pnum, int offset, int len)
+{
+	off_t off = fio_off(fio, pnum, offset);
+
+	switch (fio->type) {
+	case FIO_MMAP:
+		// Straight from the mapping unless past the end of the file
+		if (off + fio_span(fio, offset, len) > fio->size)
+			return fio_pread(fio, dst, pnum, offset, len);
+		fio_gather(fio, dst, (uint8_t *)fio->addr + off, offset, len);
+		return len;
+	case FIO_PREAD:
+		return fio_pread(fio, dst, pnum, offset, len);
+	default:
+		return fio_read_uring(fio, dst, pnum, offset, len);
+	}
+}
+
+/**
+ * Declares the dump as made of page_sz data bytes followed by oob_sz OOB
+ * bytes, as nanddump --oob writes it, to be called before any read
+ */
+int fio_set_oob(struct fio *fio, int page_sz, int oob_sz)
+{
+	if (page_sz <= 0 || oob_sz < 0 || fio->peb_sz % page_sz)
+		return -1;
+
+	fio->oob_page_sz = page_sz;
+	fio->oob_sz = oob_sz;
+	fio->peb_stride = (off_t)fio->peb_sz / page_sz * (page_sz + oob_sz);
+	free(fio->oob_scratch);
+	if (!(fio->oob_scratch = malloc(oob_sz ? oob_sz : 1)))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Whether the OOB of the 1st or 2nd page of PEB pnum carries a bad block
+ * marker, i.e. anything but 0xFF at the factory marker position
+ */
+int fio_peb_bad(struct fio *fio, int pnum)
+{
+	int pos = fio->oob_page_sz > 512 ? 0 : 5;
+
+	if (!fio->oob_sz || fio->oob_sz <= pos)
+		return 0;
+
+	for (int page = 0; page < 2; page++) {
+		uint8_t bbm;
+
+		if (pread_full(fio->fd, &bbm, 1, (off_t)pnum * fio->peb_stride +
+			       (off_t)page * (fio->oob_page_sz + fio->oob_sz) +
+			       fio->oob_page_sz + pos) < 0 ||
+		    bbm != 0xFF)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Falls back to pread if io_uring can't be set up, e.g. on older kernels
+ * or when it is disabled by seccomp or sysctl
+ */
+int fio_open(struct fio *fio, const char *path, int type, int qd, int peb_sz)
+{
+	struct stat st;
+
+	memset(fio, 0, sizeof(*fio));
+	fio->type = type;
+	fio->peb_sz = peb_sz;
+	fio->peb_stride = peb_sz;
+	fio->qd = qd > 0 ? qd : 1;
+
+	if ((fio->fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fio->fd, &st) == -1)
+		goto fail;
+	fio->size = st.st_size;
+
+	if (type == FIO_MMAP) {
+		fio->addr = mmap(NULL, fio->size, PROT_READ, MAP_PRIVATE,
+				 fio->fd, 0);
+		if (fio->addr == MAP_FAILED)
+			goto fail;
+		return 0;
+	}
+
+	if (type == FIO_URING && uring_setup(fio, fio->qd)) {
+		warn("io_uring unavailable, falling back to pread");
+		fio->type = FIO_PREAD;
+	}
+	if (fio->type == FIO_URING) {
+		fio->reqs_nb = 2 * fio->qd;
+		if (!(fio->reqs = calloc(fio->reqs_nb, sizeof(*fio->reqs)))) {
+			uring_teardown(fio);
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	close(fio->fd);
+	fio->fd = -1;
+	return -1;
+}
+
+/**
+ *
+ */
+void fio_close(struct fio *fio)
+{
+	while (fio->head != fio->tail)
+		fio_retire(fio);
+	for (int i = 0; i < fio->reqs_nb; i++)
+		free(fio->reqs[i].buf);
+	free(fio->reqs);
+	free(fio->oob_scratch);
+	if (fio->type == FIO_URING)
+		uring_teardown(fio);
+	if (fio->type == FIO_MMAP)
+		munmap(fio->addr, fio->size);
+	close(fio->fd);
+}
@@ -0,0 +1,77 @@
+/*
+ * Input backends of the example program
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef __FLASH_IO_H__
+#define __FLASH_IO_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum {
+	FIO_MMAP,
+	FIO_PREAD,
+	FIO_URING,
+};
+
+// Announced read, reqs[] is used as a FIFO
+struct fio_req {
+	int pnum;
+	int offset;
+	int len;
+	int state;
+	int res;
+	uint8_t *buf;
+	int buf_sz;
+	int used;
+	struct iovec iov;
+};
+
+struct fio_stats {
+	unsigned int hits;		// reads served from announced ones
+	unsigned int misses;		// reads issued synchronously
+	unsigned int dropped;		// announced reads never used
+	unsigned int submits;		// io_uring_enter() calls
+};
+
+struct fio {
+	int type;
+	int fd;
+	char *addr;
+	off_t size;
+	int peb_sz;
+	int page_sz;			// flash_read alignment
+
+	// OOB-interleaved dumps: each page_sz data bytes followed by oob_sz
+	int oob_page_sz;
+	int oob_sz;
+	off_t peb_stride;		// PEB size in the dump
+	uint8_t *oob_scratch;
+
+	int qd;
+	struct fio_req *reqs;
+	int reqs_nb;
+	unsigned int head, queued, tail;	// submitted: [head, queued)
+	int inflight;
+	struct fio_stats stats;
+
+	// io_uring
+	int ring_fd;
+	unsigned int sq_mask, cq_mask, sq_tail, to_submit;
+	unsigned int *sq_ktail, *sq_array, *cq_khead, *cq_ktail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;		// mappings, NULL if none
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+int fio_open(struct fio *fio, const char *path, int type, int qd, int peb_sz);
+int fio_set_oob(struct fio *fio, int page_sz, int oob_sz);
+int fio_read(struct fio *fio, void *dst, int pnum, int offset, int len);
+int fio_peb_bad(struct fio *fio, int pnum);
+void fio_prefetch(struct fio *fio, int pnum, int offset, int len);
+void fio_close(struct fio *fio);
+
+#endif /* !__FLASH_IO_H__ */
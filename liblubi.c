@@ -12,78 +12,356 @@
 #include "liblubi_cfg.h"
 #include "ubi-media.h"
 #include "liblubi.h"
+#ifdef CFG_LUBI_SHA256
+#include "sha256.h"
+#endif
 
 #define DBG_FUNC_ENTRY() DBG(SGR_LGRN ">>> %s\n", __func__)
 
+#define ALIGN_UP(x, a)		(((x) + (a) - 1) & ~((a) - 1))
+#define IO_ALIGNED		__attribute__((aligned(CFG_LUBI_IO_ALIGN)))
+
+// VID headers read by the attach scan before their CRCs are computed
+// together, c.f. crc32_multi()
+#define HDR_BATCH		4
+
+// Geometry, either runtime fields of lubi_priv or compile-time constants
+#ifdef CFG_LUBI_FIXED_GEO
+#define GEO(lubi, f)		((void)(lubi), GEO_FIXED_##f)
+#define GEO_FIXED_peb_sz	CFG_LUBI_PEB_SZ
+#define GEO_FIXED_peb_min	CFG_LUBI_PEB_MIN
+#define GEO_FIXED_peb_nb	CFG_LUBI_PEB_NB
+#define GEO_FIXED_vhdr_offs	CFG_LUBI_VHDR_OFFS
+#define GEO_FIXED_data_offs	CFG_LUBI_DATA_OFFS
+#define GEO_FIXED_leb_sz	(CFG_LUBI_PEB_SZ - CFG_LUBI_DATA_OFFS)
+#define GEO_FIXED_vtbl_slots						\
+	(GEO_FIXED_leb_sz / UBI_VTBL_RECORD_SIZE > UBI_MAX_VOLUMES ?	\
+	 UBI_MAX_VOLUMES : (int)(GEO_FIXED_leb_sz / UBI_VTBL_RECORD_SIZE))
+#else
+#define GEO(lubi, f)		((lubi)->f)
+#endif
+
+// Only PEBs with a good VID header get one, in no particular order
 struct peb_rec {
-	struct ubi_ec_hdr ehdr;
 	struct ubi_vid_hdr vhdr;
+	uint16_t idx;			// PEB index, from peb_min
 	uint8_t vhdr_crc_ok;
-	uint8_t unused[3];
+	uint8_t bad;
+	// Bytes of data whose CRC passed since the VID header was read, 0
+	// if not verified, c.f. lubi_peb_verified()
+	uint32_t data_ok_sz;
+};
+
+// Attach states, c.f. lubi_attach_step()
+enum {
+	ATT_NONE,			// not attached, or failed
+	ATT_ECS,
+	ATT_VIDS,
+	ATT_LVL,
+	ATT_OTHERS,
+	ATT_DONE,
 };
 
+// Budget of the steps run by the one-shot calls
+#define BUDGET_ALL		(1 << 30)
+
+// PEBs scanned by a fast attach between checks of its targets
+#define FAST_STEP		16
+
 struct leb2peb {
 	uint8_t dcrc_ok;
-	uint8_t unused;
+	uint8_t mapped;
 	uint16_t peb;
 };
 
+struct lubi_rd {
+	int vol_id;
+	unsigned int max_lnum;
+	int usable_leb_sz;
+	int dynamic;
+	int reserved_lebs;
+	uint8_t *buf;
+	int buf_sz;
+	lubi_leb_fn_t leb_fn;
+	void *leb_arg;
+	uint8_t *sha256;
+	int verify;
+	struct lubi_leb_crc *deferred;
+	int deferred_max;
+	int deferred_nb;
+	lubi_place_fn_t place_fn;
+	void *place_arg;
+	int skip;			// bytes of LEB 0 left out of buf
+
+	// Progress, c.f. lubi_read_step()
+	int used_ebs;
+	int lnum;			// next LEB to read
+	int lebs_ok;
+	int ret_len;
+#ifdef CFG_LUBI_SHA256
+	struct lubi_sha256_ctx sha256_ctx;
+#endif
+};
+
+// Scratch mem, shared by the partitions of lubi_init_parts()
+struct lubi_scratch {
+	struct peb_rec recs[HDR_BATCH];
+	struct leb2peb leb2pebs[CFG_LUBI_PEB_NB_MAX];
+	uint8_t leb[CFG_LUBI_PEB_SZ_MAX] IO_ALIGNED;
+	uint8_t page[CFG_LUBI_PAGE_SZ_MAX] IO_ALIGNED;
+
+#if CFG_LUBI_TRACE_NB
+	// Kept across attaches, trace_nb wraps around the ring
+	struct lubi_trace_ev trace[CFG_LUBI_TRACE_NB];
+	unsigned int trace_nb;
+#endif
+};
+
 struct lubi_priv {
 	// user args
 	void *ext_priv;
 	flash_read_fn_t ext_flash_read;
+	lubi_prefetch_fn_t ext_prefetch;
+	int prefetch_ahead;
+	lubi_bad_peb_fn_t ext_is_bad;
+#if CFG_LUBI_TRACE_NB
+	lubi_clock_fn_t ext_clock;
+#endif
+	int fast_window;		// -1 unless lubi_set_fast_attach()
+#ifndef CFG_LUBI_FIXED_GEO
 	int peb_sz;
 	int peb_nb;
 	int peb_min;
+#endif
+	int io_page_sz;
+	int io_align;
 
 	// Zeroed by scan {
 	// scan dyn params
 	char scan_mem_start[0];
+#ifndef CFG_LUBI_FIXED_GEO
 	uint32_t leb_sz;
 	uint32_t vhdr_offs;
 	uint32_t data_offs;
 	int vtbl_slots;
+#endif
 
 #if CFG_LUBI_USE_LVL
-	uint8_t vtbls_buf[2 * CFG_LUBI_PEB_SZ_MAX];
+	uint8_t vtbls_buf[2 * CFG_LUBI_PEB_SZ_MAX] IO_ALIGNED;
 	struct ubi_vtbl_record *vtbl_recs;
 #endif
 
-	struct peb_rec pebs[CFG_LUBI_PEB_NB_MAX];
+	// Attach progress, c.f. lubi_attach_step()
+	int att_state;			// ATT_*
+	int att_next;			// next PEB index to scan
+	int att_end;			// where the VID scan stops
+	int att_resume;			// VID scan to go on with, if not 0
+	int att_fast;			// targets checked, c.f. lubi_fast_check()
+	uint32_t att_vhdr_offs;		// that of lubi_scan_ecs()
+	const struct lubi_target *att_targets;	// NULL if no name to resolve
+	int att_nb;
+
+	// Targeted attach: records are only kept for the layout volume and
+	// targets[], the other PEBs with a good VID header are set in others
+	int targeted;
+	int targets[CFG_LUBI_TARGETS_MAX];
+	int targets_nb;
+	uint8_t others[(CFG_LUBI_PEB_NB_MAX + 7) / 8];
+
+	struct peb_rec pebs[CFG_LUBI_RECS_MAX];
+	int recs_nb;
+	struct lubi_stats stats;
+
+	// Time-sliced read, c.f. lubi_read_step()
+	struct lubi_rd step_rd;
+	int step_active;
+	int *step_deferred_nb;
 	char scan_mem_end[0];
 	// }
 
-	// scratch mem
-	struct leb2peb scratch_leb2pebs[CFG_LUBI_PEB_NB_MAX];
-	uint8_t scratch_leb[CFG_LUBI_PEB_SZ_MAX];
+	// That of the first partition of lubi_init_parts(), else own_scratch
+	struct lubi_scratch *scratch;
+	int parts_nb;			// nb in the first partition, else 1
+
+	// Only in the first partition
+	struct lubi_scratch own_scratch;
 };
 
+// Partitions of lubi_init_parts() but the first one
+#define PART_SZ	ALIGN_UP(__builtin_offsetof(struct lubi_priv, own_scratch), \
+			 CFG_LUBI_IO_ALIGN)
+
+/**
+ * Start time of an event to trace, 0 when not tracing
+ */
+static inline uint64_t trace_start(const struct lubi_priv *lubi)
+{
+#if CFG_LUBI_TRACE_NB
+	if (lubi->ext_clock)
+		return lubi->ext_clock(lubi->ext_priv);
+#endif
+	(void)lubi;
+	return 0;
+}
+
+/**
+ * Records an event which started at ts in the trace ring, overwriting the
+ * oldest one when full
+ */
+static inline void trace_ev(struct lubi_priv *lubi, int type, int id,
+			    uint64_t ts, int pnum, uint32_t offset,
+			    uint32_t len, int ret)
+{
+#if CFG_LUBI_TRACE_NB
+	struct lubi_trace_ev *ev;
+
+	if (!lubi->ext_clock)
+		return;
+
+	ev = &lubi->scratch->trace[lubi->scratch->trace_nb++ % CFG_LUBI_TRACE_NB];
+	ev->ts = ts;
+	ev->dur = lubi->ext_clock(lubi->ext_priv) - ts;
+	ev->type = type;
+	ev->id = id;
+	ev->pnum = pnum;
+	ev->offset = offset;
+	ev->len = len;
+	ev->ret = ret;
+#else
+	(void)lubi; (void)type; (void)id; (void)ts; (void)pnum;
+	(void)offset; (void)len; (void)ret;
+#endif
+}
+
+/**
+ * CRC of len bytes read from PEB pnum at offset, traced as a LUBI_CRC_* id
+ */
+static uint32_t lubi_crc(struct lubi_priv *lubi, int id, int pnum,
+			 uint32_t offset, const void *buf, uint32_t len)
+{
+	uint64_t ts = trace_start(lubi);
+	uint32_t crc = crc32(buf, len);
+
+	trace_ev(lubi, LUBI_EV_CRC, id, ts, pnum, offset, len, 0);
+
+	return crc;
+}
+
+/**
+ *
+ */
+static int ext_flash_read(struct lubi_priv *lubi, void *dst, int pnum,
+			  int offset, int len)
+{
+	uint64_t ts = trace_start(lubi);
+	int ret;
+
+	lubi->stats.flash_reads++;
+	lubi->stats.flash_bytes += len;
+
+	ret = lubi->ext_flash_read(lubi->ext_priv, dst, pnum, offset, len);
+	trace_ev(lubi, LUBI_EV_READ, 0, ts, pnum, offset, len, ret);
+
+	return ret;
+}
+
+/**
+ * Keeps the next reads of the PEB headers at offset announced, ahead of
+ * lubi_scan_*() going through the PEBs in order
+ */
+static void prefetch_hdrs(struct lubi_priv *lubi, int i, int offset, int len)
+{
+	int end = i + lubi->prefetch_ahead;
+
+	if (!lubi->ext_prefetch)
+		return;
+
+	for (int j = i ? end - 1 : 0; j < end && j < GEO(lubi, peb_nb); j++)
+		lubi->ext_prefetch(lubi->ext_priv, GEO(lubi, peb_min) + j,
+				   offset, len);
+}
+
 /**
+ * Unless lubi_set_io_align() was called, reads exactly len bytes at offset
  *
+ * Otherwise flash_read is only ever called with page-aligned offsets and
+ * lengths and io_align-aligned destinations: the pages are read straight
+ * into dst as long as it is aligned and room (>= len) bytes may be written
+ * to it, the remaining bytes go through the scratch page
  */
 static int flash_read(struct lubi_priv *lubi, void *dst, int pnum, int offset,
-		      int len)
+		      int len, int room)
+{
+	int page_sz = lubi->io_page_sz;
+	uint8_t *p = dst;
+
+	if (!page_sz)
+		return ext_flash_read(lubi, dst, pnum, offset, len);
+
+	if (!(offset & (page_sz - 1)) &&
+	    !((uintptr_t)dst & (lubi->io_align - 1))) {
+		int chunk = room >= ALIGN_UP(len, page_sz) ?
+			    ALIGN_UP(len, page_sz) : len & ~(page_sz - 1);
+
+		if (chunk)
+			ext_flash_read(lubi, p, pnum, offset, chunk);
+		if (chunk >= len)
+			return len;
+		p += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	while (len > 0) {
+		int head = offset & (page_sz - 1);
+		int chunk = page_sz - head < len ? page_sz - head : len;
+
+		ext_flash_read(lubi, lubi->scratch->page, pnum, offset - head,
+			       page_sz);
+		memcpy(p, lubi->scratch->page + head, chunk);
+		p += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return p - (uint8_t *)dst;
+}
+
+/**
+ * Reads the EC header of PEB index i into ehdr, returns whether it is valid
+ */
+static int lubi_read_ec(struct lubi_priv *lubi, int i, struct ubi_ec_hdr *ehdr)
 {
-	return lubi->ext_flash_read(lubi->ext_priv, dst, pnum, offset, len);
+	flash_read(lubi, ehdr, GEO(lubi, peb_min) + i, 0,
+		   sizeof(struct ubi_ec_hdr), sizeof(struct ubi_ec_hdr));
+
+	return ehdr->magic == __be32_to_cpu(UBI_EC_HDR_MAGIC) &&
+	       lubi_crc(lubi, LUBI_CRC_EC_HDR, GEO(lubi, peb_min) + i, 0,
+			ehdr, UBI_EC_HDR_SIZE_CRC) ==
+	       __be32_to_cpu(ehdr->hdr_crc);
 }
 
+#ifndef CFG_LUBI_FIXED_GEO
 /**
- * Gets the dynamics offsets from the valid EC headers
+ * Gets the dynamics offsets from the valid EC headers of the PEBs
+ * [from, to)
  * 	from the 1st one if vhdr_offs == 0
  * 	else from the 1st one which vid_hdr_offset == vhdr_offs
+ *
+ * Returns the index of that PEB, -1 if there is none
  */
-static int lubi_scan_ecs(struct lubi_priv *lubi, uint32_t vhdr_offs)
+static int lubi_scan_ecs(struct lubi_priv *lubi, uint32_t vhdr_offs,
+			 int from, int to)
 {
 	DBG_FUNC_ENTRY();
 
-	for (int i = 0; i < lubi->peb_nb; i++) {
-		struct peb_rec *peb = &lubi->pebs[i];
-		struct ubi_ec_hdr *ehdr = &peb->ehdr;
-
-		flash_read(lubi, ehdr, lubi->peb_min + i, 0, sizeof(struct ubi_ec_hdr));
+	for (int i = from; i < to; i++) {
+		struct ubi_ec_hdr hdr, *ehdr = &hdr;
 
-		if (ehdr->magic == __be32_to_cpu(UBI_EC_HDR_MAGIC) &&
-		    crc32(ehdr, UBI_EC_HDR_SIZE_CRC) == __be32_to_cpu(ehdr->hdr_crc)) {
+		prefetch_hdrs(lubi, i, 0, sizeof(struct ubi_ec_hdr));
+		if (lubi->ext_is_bad &&
+		    lubi->ext_is_bad(lubi->ext_priv, GEO(lubi, peb_min) + i))
+			continue;
+		if (lubi_read_ec(lubi, i, ehdr)) {
 			uint32_t voffs = __be32_to_cpu(ehdr->vid_hdr_offset);
 
 			if (vhdr_offs && vhdr_offs != voffs)
@@ -92,320 +370,2002 @@ static int lubi_scan_ecs(struct lubi_priv *lubi, uint32_t vhdr_offs)
 			lubi->vhdr_offs = voffs;
 			lubi->data_offs = __be32_to_cpu(ehdr->data_offset);
 
-			return 0;
+			return i;
 		}
 	}
 	return -1;
 }
+#endif
 
 /**
- *
+ * Reads the VID header of PEB index i into peb, to be checked by
+ * lubi_check_vids()
  */
-static int lubi_scan_vids(struct lubi_priv *lubi)
+static void lubi_read_vid(struct lubi_priv *lubi, int i, struct peb_rec *peb)
 {
-	DBG_FUNC_ENTRY();
+	peb->idx = i;
+	peb->vhdr_crc_ok = 0;
+	peb->data_ok_sz = 0;
+
+	// Bad PEBs are left out as if they held no VID header
+	peb->bad = lubi->ext_is_bad &&
+		   lubi->ext_is_bad(lubi->ext_priv, GEO(lubi, peb_min) + i);
+	if (peb->bad) {
+		DBG(SGR_BRED "%s: PEB %d is bad\n", __func__,
+		    GEO(lubi, peb_min) + i);
+		return;
+	}
+
+	flash_read(lubi, &peb->vhdr, GEO(lubi, peb_min) + i,
+		   GEO(lubi, vhdr_offs), sizeof(struct ubi_vid_hdr),
+		   sizeof(struct ubi_vid_hdr));
+}
+
+/**
+ * Checks the VID headers of the nb (<= HDR_BATCH) records read by
+ * lubi_read_vid(), their CRCs being computed in one go
+ */
+static void lubi_check_vids(struct lubi_priv *lubi, struct peb_rec *pebs,
+			    int nb)
+{
+	const uint8_t *bufs[HDR_BATCH];
+	uint32_t crcs[HDR_BATCH];
+	int idx[HDR_BATCH], n = 0;
+	uint64_t ts = trace_start(lubi);
+
+	for (int k = 0; k < nb; k++) {
+		if (pebs[k].bad ||
+		    pebs[k].vhdr.magic != __be32_to_cpu(UBI_VID_HDR_MAGIC))
+			continue;
+		idx[n] = k;
+		bufs[n++] = (const uint8_t *)&pebs[k].vhdr;
+	}
+	if (!n)
+		return;
 
-	for (int i = 0; i < lubi->peb_nb; i++) {
-		struct peb_rec *peb = &lubi->pebs[i];
-		struct ubi_vid_hdr *vhdr = &peb->vhdr;
+	crc32_multi(bufs, UBI_VID_HDR_SIZE_CRC, crcs, n);
+	trace_ev(lubi, LUBI_EV_CRC, LUBI_CRC_VID_HDR, ts,
+		 GEO(lubi, peb_min) + pebs[idx[0]].idx, GEO(lubi, vhdr_offs),
+		 n * UBI_VID_HDR_SIZE_CRC, 0);
 
-		flash_read(lubi, vhdr, lubi->peb_min + i, lubi->vhdr_offs,
-			   sizeof(struct ubi_vid_hdr));
+	for (int j = 0; j < n; j++) {
+		struct peb_rec *peb = &pebs[idx[j]];
+		const struct ubi_vid_hdr *vhdr = &peb->vhdr;
 
-		if (vhdr->magic != __be32_to_cpu(UBI_VID_HDR_MAGIC) ||
-		    crc32(vhdr, UBI_VID_HDR_SIZE_CRC) != __be32_to_cpu(vhdr->hdr_crc))
+		if (crcs[j] != __be32_to_cpu(vhdr->hdr_crc))
 			continue;
 
 		peb->vhdr_crc_ok = 1;
 
 		DBG("%s:%3d: PEB %3d @ %08x: vol_id %8X lnum %5d sqnum %5lld\n",
-		    __func__, __LINE__, lubi->peb_min + i,
-		    (lubi->peb_min + i) * lubi->peb_sz,
+		    __func__, __LINE__, GEO(lubi, peb_min) + peb->idx,
+		    (GEO(lubi, peb_min) + peb->idx) * GEO(lubi, peb_sz),
 		    __be32_to_cpu(vhdr->vol_id), __be32_to_cpu(vhdr->lnum),
 		    (long long)__be64_to_cpu(vhdr->sqnum));
 	}
+}
+
+/**
+ * Whether the PEB record is kept, i.e. holds a LEB of the layout volume or
+ * of one of the targets[] of a targeted attach
+ */
+static int lubi_keep_rec(const struct lubi_priv *lubi,
+			 const struct peb_rec *peb)
+{
+	uint32_t vol_id = __be32_to_cpu(peb->vhdr.vol_id);
+
+	if (!lubi->targeted || vol_id == UBI_LAYOUT_VOLUME_ID)
+		return 1;
+
+	for (int t = 0; t < lubi->targets_nb; t++)
+		if (vol_id == (uint32_t)lubi->targets[t])
+			return 1;
+
 	return 0;
 }
 
 /**
+ * Keeps the checked record peb if it is to be kept, in place of the record
+ * r of its PEB if it had one (r >= 0), which is dropped otherwise
  *
+ * Returns -1 when out of records
  */
-static int check_vtbl(const struct lubi_priv *lubi,
-		      const struct ubi_vtbl_record *recs)
+static int lubi_put_rec(struct lubi_priv *lubi, const struct peb_rec *peb,
+			int r)
 {
-	for (int i = 0; i < lubi->vtbl_slots; i++) {
-		if (crc32(&recs[i], UBI_VTBL_RECORD_SIZE_CRC) !=
-		    __be32_to_cpu(recs[i].crc))
-			return -1;
+	int i = peb->idx;
+	uint8_t bit = 1 << (i & 7);
+
+	lubi->others[i >> 3] &= ~bit;
+	if (!peb->vhdr_crc_ok || !lubi_keep_rec(lubi, peb)) {
+		if (peb->vhdr_crc_ok)
+			lubi->others[i >> 3] |= bit;
+		if (r >= 0)
+			lubi->pebs[r] = lubi->pebs[--lubi->recs_nb];
+	} else if (r >= 0) {
+		lubi->pebs[r] = *peb;
+	} else if (lubi->recs_nb < CFG_LUBI_RECS_MAX) {
+		lubi->pebs[lubi->recs_nb++] = *peb;
+	} else {
+		DBG(SGR_BRED "%s: PEB %d: out of records (%d)\n", __func__,
+		    GEO(lubi, peb_min) + i, CFG_LUBI_RECS_MAX);
+		return -1;
 	}
+
+	lubi->stats.pebs_kept = lubi->recs_nb;
+
 	return 0;
 }
 
 /**
+ * Scans PEB index i into scratch->recs[0] and keeps or drops its record,
+ * c.f. lubi_put_rec()
  *
+ * Its EC header is checked as well: the PEB may be in the middle of an
+ * erase, or have been rewritten with other offsets, since lubi_attach()
  */
-int lubi_read_svol(void *priv, void *buf, int vol_id, unsigned int max_lnum,
-		   __attribute__((unused)) int pad)
+static int lubi_add_peb(struct lubi_priv *lubi, int i, int r)
 {
-	struct lubi_priv *lubi = priv;
-	struct leb2peb *leb2pebs = lubi->scratch_leb2pebs;
-	int usable_leb_sz;
-	int ret_len = 0, lebs_ok = 0, used_ebs = -1;
-	int is_lvl, dcrc_ok;
-
-	DBG_FUNC_ENTRY();
-
-	is_lvl = vol_id == UBI_LAYOUT_VOLUME_ID;
+	struct peb_rec *peb = &lubi->scratch->recs[0];
+	struct ubi_ec_hdr ehdr;
 
-#if CFG_LUBI_USE_LVL
-	if (is_lvl)
-		usable_leb_sz = lubi->leb_sz;
-	else if (!lubi->vtbl_recs ||
-		  lubi->vtbl_recs[vol_id].vol_type != UBI_VID_STATIC)
-			return -1;
-	else
-		usable_leb_sz = lubi->leb_sz -
-				__be32_to_cpu(lubi->vtbl_recs[vol_id].data_pad);
-#else
-	usable_leb_sz = lubi->leb_sz - pad;
-#endif
+	lubi_read_vid(lubi, i, peb);
+	lubi_check_vids(lubi, peb, 1);
+	if (peb->vhdr_crc_ok && (!lubi_read_ec(lubi, i, &ehdr) ||
+	    __be32_to_cpu(ehdr.vid_hdr_offset) != GEO(lubi, vhdr_offs))) {
+		DBG(SGR_BRED "%s: PEB %d: bad EC header\n", __func__,
+		    GEO(lubi, peb_min) + i);
+		peb->vhdr_crc_ok = 0;
+	}
 
-	if (max_lnum > CFG_LUBI_PEB_NB_MAX - 1)
-		max_lnum = CFG_LUBI_PEB_NB_MAX - 1;
+	return lubi_put_rec(lubi, peb, r);
+}
 
-	memset(leb2pebs, 0, (max_lnum + 1) * sizeof(leb2pebs[0]));
+/**
+ * Checks the nb records of scratch->recs and keeps those to be kept
+ */
+static int lubi_put_batch(struct lubi_priv *lubi, int nb, int others_only)
+{
+	lubi_check_vids(lubi, lubi->scratch->recs, nb);
 
-	for (int i = 0; i < lubi->peb_nb; i++) {
-		struct peb_rec *peb = &lubi->pebs[i];
-		struct ubi_vid_hdr *prev_vhdr = NULL, *vhdr = &peb->vhdr;
-		uint32_t lnum, len, prev_len;
-		struct leb2peb *l2p;
-		void *buf_dst, *rd_dst;
+	for (int k = 0; k < nb; k++) {
+		if (lubi_put_rec(lubi, &lubi->scratch->recs[k], -1))
+			return -1;
+		if (!others_only)
+			lubi->stats.bad_pebs += lubi->scratch->recs[k].bad;
+	}
 
-		if (!peb->vhdr_crc_ok ||
-		    vhdr->vol_id != __cpu_to_be32(vol_id))
-			continue;
+	return 0;
+}
 
-		lnum = __be32_to_cpu(vhdr->lnum);
-		if (lnum > max_lnum)
-			continue;
+/**
+ * Scans the PEBs [from, to), or only those of them set in others after the
+ * targets of a targeted attach were resolved, HDR_BATCH of them at a time
+ */
+static int lubi_scan_vids(struct lubi_priv *lubi, int others_only, int from,
+			  int to)
+{
+	int nb = 0;
 
-		l2p = &leb2pebs[lnum];
-		buf_dst = (uint8_t *)buf + lnum * usable_leb_sz;
-		// The layout volume is special-cased because of the way :(
-		// Linux-UBI handles its data_{crc,size} when restoring it
-		//
-		// Linux-UBI uses the LEB size to compute vtbl_slots
-		//
-		// To improve any diagnostic and ease ret_len computation we
-		// could check that in case of data and unless we are parsing
-		// the latest LEB, data_size is usable_leb_sz
-		len = is_lvl ? lubi->vtbl_slots * UBI_VTBL_RECORD_SIZE :
-			       __be32_to_cpu(vhdr->data_size);
-		if (!l2p->dcrc_ok) {
-			rd_dst = buf_dst;
-		} else {
-			prev_vhdr = &lubi->pebs[l2p->peb].vhdr;
+	DBG_FUNC_ENTRY();
 
-			if (__be64_to_cpu(vhdr->sqnum) < __be64_to_cpu(prev_vhdr->sqnum))
+	for (int i = from; i < to; i++) {
+		if (others_only) {
+			if (!(lubi->others[i >> 3] & 1 << (i & 7)))
 				continue;
-
-			rd_dst = lubi->scratch_leb;
-			// clobber the buffer
-			memset(rd_dst + len - len / 8, 0x5A, len / 8);
+		} else {
+			prefetch_hdrs(lubi, i, GEO(lubi, vhdr_offs),
+				      sizeof(struct ubi_vid_hdr));
 		}
 
-		flash_read(lubi, rd_dst, lubi->peb_min + i, lubi->data_offs,
-			   len);
-
-		if (is_lvl)
-			dcrc_ok = !check_vtbl(lubi, rd_dst);
-		else
-			dcrc_ok = crc32(rd_dst, len) == __be32_to_cpu(vhdr->data_crc);
-
-		if (dcrc_ok) {
-			l2p->peb = i;
-			if (!l2p->dcrc_ok) {
-				l2p->dcrc_ok = 1;
-				lebs_ok++;
-			} else {
-				prev_len = is_lvl ?
-					   len : __be32_to_cpu(prev_vhdr->data_size);
-
-				memmove(buf_dst, rd_dst, len);
-				ret_len -= prev_len;
-			}
-			ret_len += len;
-			// Pick used_ebs from the last PEB with data crc ok
-			used_ebs = __be32_to_cpu(vhdr->used_ebs);
+		lubi_read_vid(lubi, i, &lubi->scratch->recs[nb++]);
+		if (nb == HDR_BATCH) {
+			if (lubi_put_batch(lubi, nb, others_only))
+				return -1;
+			nb = 0;
 		}
 	}
 
-	DBG(SGR_BRST "%s: Volume \"%s\"\n\tEBs used / ok: %d / %d\n\tread %d bytes\n",
-	    __func__, is_lvl ? NULL : lubi->vtbl_recs[vol_id].name, used_ebs,
-	    lebs_ok, ret_len);
+	return lubi_put_batch(lubi, nb, others_only);
+}
 
-	if (ret_len && lebs_ok == used_ebs) {
-		int expected;
-		int last_peb = leb2pebs[used_ebs - 1].peb;
+/**
+ * Checks the vtbl copy read from PEB pnum, traced as a whole
+ */
+static int check_vtbl(struct lubi_priv *lubi,
+		      const struct ubi_vtbl_record *recs, int pnum)
+{
+	uint64_t ts = trace_start(lubi);
+	int ret = 0;
 
-		if (lebs_ok)
-			expected = usable_leb_sz * (used_ebs - 1) +
-				   __be32_to_cpu(lubi->pebs[last_peb].vhdr.data_size);
-		else
-			expected = 0;
-		if (expected != ret_len) {
-			DBG(SGR_BRED "%s: Expected %d bytes - read %d\n",
-			    __func__, expected, ret_len);
-			return -1;
-		}
-	} else {
-		// Do not return an error in case we could get 1 LEB from the LVL
-		if (!is_lvl || lebs_ok < 1) {
-			DBG(SGR_BRED "%s: Volume read failure (read %d bytes)\n",
-			    __func__, ret_len);
-			return -1;
+	for (int i = 0; i < GEO(lubi, vtbl_slots); i++) {
+		if (crc32(&recs[i], UBI_VTBL_RECORD_SIZE_CRC) !=
+		    __be32_to_cpu(recs[i].crc)) {
+			ret = -1;
+			break;
 		}
 	}
+	trace_ev(lubi, LUBI_EV_CRC, LUBI_CRC_VTBL, ts, pnum,
+		 GEO(lubi, data_offs),
+		 GEO(lubi, vtbl_slots) * UBI_VTBL_RECORD_SIZE, ret);
 
-	return ret_len;
+	return ret;
 }
 
-#if CFG_LUBI_USE_LVL
 /**
- *
+ * Returns the record of the PEB holding the most recent copy of LEB lnum
+ * older than sqnum_lim, or -1 if there is none
  */
-int lubi_list_vols(const void *priv)
+static int lubi_find_leb(const struct lubi_priv *lubi, int vol_id,
+			 uint32_t lnum, uint64_t sqnum_lim)
 {
-	const struct lubi_priv *lubi = priv;
-	struct ubi_vtbl_record *recs = lubi->vtbl_recs;
+	uint64_t best_sqnum = 0;
+	int best = -1;
 
-	DBG_FUNC_ENTRY();
+	for (int i = 0; i < lubi->recs_nb; i++) {
+		const struct ubi_vid_hdr *vhdr = &lubi->pebs[i].vhdr;
+		uint64_t sqnum;
 
-	if (!recs)
-		return -1;
+		if (!lubi->pebs[i].vhdr_crc_ok ||
+		    vhdr->vol_id != __cpu_to_be32(vol_id) ||
+		    vhdr->lnum != __cpu_to_be32(lnum))
+			continue;
 
-	for (int i = 0; i < lubi->vtbl_slots; i++)
-		if (recs[i].name_len)
-			DBG(SGR_BRST "\tfound %40s: upd_marker:%d type:%s\n",
-			    recs[i].name, recs[i].upd_marker,
-			    recs[i].vol_type == UBI_VID_STATIC ?
-			    "static" : "dynamic");
+		sqnum = __be64_to_cpu(vhdr->sqnum);
+		if (sqnum >= sqnum_lim || (best >= 0 && sqnum < best_sqnum))
+			continue;
 
-	return 0;
+		best_sqnum = sqnum;
+		best = i;
+	}
+	return best;
 }
 
 /**
- *
+ * Maps each LEB of the volume to the PEB holding its most recent copy
+ * according to the VID headers only
  */
-int lubi_get_vol_id(const void *priv, const char *name, int *upd_marker)
+static void lubi_map_lebs(struct lubi_priv *lubi, int vol_id,
+			  unsigned int max_lnum)
 {
-	const struct lubi_priv *lubi = priv;
-	struct ubi_vtbl_record *recs = lubi->vtbl_recs;
-	size_t len;
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
 
-	DBG_FUNC_ENTRY();
+	memset(leb2pebs, 0, (max_lnum + 1) * sizeof(leb2pebs[0]));
 
-	if (!recs)
-		return -1;
+	for (int i = 0; i < lubi->recs_nb; i++) {
+		struct ubi_vid_hdr *vhdr = &lubi->pebs[i].vhdr;
+		struct leb2peb *l2p;
+		uint32_t lnum;
 
-	len = strlen(name); // strnlen(name, UBI_VOL_NAME_MAX + 1) if available
+		if (!lubi->pebs[i].vhdr_crc_ok ||
+		    vhdr->vol_id != __cpu_to_be32(vol_id))
+			continue;
 
-	if (!len || len > UBI_VOL_NAME_MAX)
-		return -1;
+		lnum = __be32_to_cpu(vhdr->lnum);
+		if (lnum > max_lnum)
+			continue;
 
-	len = __cpu_to_be16(len);
-	for (int i = 0; i < lubi->vtbl_slots; i++) {
-#if 0 // ATM liblubi doesn't accept damaged LVLs so the following can't happen
-		if (crc32(&recs[i], UBI_VTBL_RECORD_SIZE_CRC) !=
-		    __be32_to_cpu(recs[i].crc)) {
-			DBG(SGR_BRED "%s: Bad VTBL rec\n", __func__);
+		l2p = &leb2pebs[lnum];
+		if (l2p->mapped &&
+		    __be64_to_cpu(vhdr->sqnum) <
+		    __be64_to_cpu(lubi->pebs[l2p->peb].vhdr.sqnum))
 			continue;
-		}
-#endif
-		if (len == recs[i].name_len &&
-		    !strcmp((const char *)recs[i].name, name)) {
-			*upd_marker = recs[i].upd_marker;
-			return i;
-		}
+
+		l2p->peb = i;
+		l2p->mapped = 1;
 	}
+}
 
-	return -1;
+/**
+ * Number of bytes to read from a PEB holding a LEB of the volume
+ */
+static uint32_t lubi_leb_len(const struct lubi_priv *lubi,
+			     const struct lubi_rd *rd,
+			     const struct ubi_vid_hdr *vhdr)
+{
+	// The layout volume is special-cased because of the way :(
+	// Linux-UBI handles its data_{crc,size} when restoring it
+	//
+	// Linux-UBI uses the LEB size to compute vtbl_slots
+	//
+	// Dynamic LEBs are read whole, their data_{crc,size} are only
+	// valid when copy_flag is set
+	if (rd->vol_id == UBI_LAYOUT_VOLUME_ID)
+		return GEO(lubi, vtbl_slots) * UBI_VTBL_RECORD_SIZE;
+	if (rd->dynamic)
+		return rd->usable_leb_sz;
+	return __be32_to_cpu(vhdr->data_size);
 }
-#endif
 
 /**
- *
+ * Keeps the reads of the prefetch_ahead LEBs following lnum announced,
+ * from the PEBs lubi_map_lebs() picked
  */
-int lubi_attach(void *priv, uint32_t vhdr_offs, uint32_t data_offs)
+static void prefetch_lebs(struct lubi_priv *lubi, const struct lubi_rd *rd,
+			  int lnum, int used_ebs)
 {
-	struct lubi_priv *lubi = priv;
-#if CFG_LUBI_USE_LVL
-	struct leb2peb *leb2pebs = lubi->scratch_leb2pebs;
-#endif
+	const struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	int end = lnum + lubi->prefetch_ahead;
 
-	DBG_FUNC_ENTRY();
+	if (!lubi->ext_prefetch)
+		return;
 
-	memset(lubi->scan_mem_start, 0,
-	       __builtin_offsetof(struct lubi_priv, scan_mem_end) -
-	       __builtin_offsetof(struct lubi_priv , scan_mem_start));
+	for (int l = lnum ? end - 1 : 0; l < end && l < used_ebs; l++) {
+		const struct ubi_vid_hdr *vhdr;
+		uint32_t len;
 
-	if (!vhdr_offs || !data_offs) {
-		// if vhdr_offs == 0, data_offs is not used
-		if (lubi_scan_ecs(lubi, vhdr_offs) < 0)
-			return -1;
-	} else {
-		lubi->vhdr_offs = vhdr_offs;
-		lubi->data_offs = data_offs;
+		if (!leb2pebs[l].mapped)
+			continue;
+		vhdr = &lubi->pebs[leb2pebs[l].peb].vhdr;
+		len = lubi_leb_len(lubi, rd, vhdr);
+		if (len > (uint32_t)rd->usable_leb_sz)
+			continue;
+		lubi->ext_prefetch(lubi->ext_priv, GEO(lubi, peb_min) +
+				   lubi->pebs[leb2pebs[l].peb].idx,
+				   GEO(lubi, data_offs), len);
 	}
-	lubi->leb_sz = lubi->peb_sz - lubi->data_offs;
-	lubi->vtbl_slots = lubi->leb_sz / UBI_VTBL_RECORD_SIZE;
-	if (lubi->vtbl_slots > UBI_MAX_VOLUMES)
-		lubi->vtbl_slots = UBI_MAX_VOLUMES;
-
-	if (lubi_scan_vids(lubi))
-		return -1;
-
-#if CFG_LUBI_USE_LVL
-	if (lubi_read_svol(lubi, lubi->vtbls_buf, UBI_LAYOUT_VOLUME_ID, 1, 0) < 0)
-		return -1;
-
-	for (int i = 0; i < 2; i++)
-		DBG("LVL: LEB[%1d] -> PEB[%3d] - data crc: %s\n",
-		    i, lubi->peb_min + leb2pebs[i].peb,
-		    leb2pebs[i].dcrc_ok ? "good" : "bad");
-
-	if (leb2pebs[0].dcrc_ok)
-		lubi->vtbl_recs = (void *)&lubi->vtbls_buf[0];
-	else if (leb2pebs[1].dcrc_ok)
-		lubi->vtbl_recs = (void *)&lubi->vtbls_buf[lubi->leb_sz];
-	else
-		return -1;
-#endif
-
-	return 0;
 }
 
 /**
- *
+ * Whether the data CRC of the PEB of record i already passed over the
+ * data_size of its VID header, the record being reset by a re-attach
  */
-int lubi_mem_sz(void)
+static int lubi_peb_verified(const struct lubi_priv *lubi, int i)
 {
-	return sizeof(struct lubi_priv);
+	const struct peb_rec *peb = &lubi->pebs[i];
+
+	return peb->data_ok_sz &&
+	       peb->data_ok_sz == __be32_to_cpu(peb->vhdr.data_size);
 }
 
 /**
- *
+ * Reads and checks LEB lnum into dst, falling back to older copies of the
+ * LEB as long as the data CRC does not match
  */
-int lubi_init(void *priv, void *ext_priv, flash_read_fn_t flash_read,
-	      int peb_sz, int peb_min, int peb_nb)
+static int lubi_read_leb(struct lubi_priv *lubi, const struct lubi_rd *rd,
+			 uint32_t lnum, uint8_t *dst, int room, int skip_crc)
 {
+	struct leb2peb *l2p = &lubi->scratch->leb2pebs[lnum];
+	int is_lvl = rd->vol_id == UBI_LAYOUT_VOLUME_ID;
+	int i = l2p->mapped ? l2p->peb : -1;
+
+	while (i >= 0) {
+		struct ubi_vid_hdr *vhdr = &lubi->pebs[i].vhdr;
+		int pnum = GEO(lubi, peb_min) + lubi->pebs[i].idx;
+		uint32_t len;
+		int dcrc_ok;
+
+		len = lubi_leb_len(lubi, rd, vhdr);
+		if (len > (uint32_t)rd->usable_leb_sz ||
+		    (vhdr->copy_flag &&
+		     __be32_to_cpu(vhdr->data_size) > (uint32_t)rd->usable_leb_sz))
+			goto next;
+
+		// clobber the scratch buffer, not the caller's memory
+		if (dst == lubi->scratch->leb)
+			memset(dst + len - len / 8, 0x5A, len / 8);
+
+		flash_read(lubi, dst, pnum, GEO(lubi, data_offs), len, room);
+
+		if (is_lvl) {
+			dcrc_ok = !check_vtbl(lubi, (void *)dst, pnum);
+		} else if ((rd->dynamic && !vhdr->copy_flag) || skip_crc) {
+			dcrc_ok = 1;
+		} else if (lubi_peb_verified(lubi, i)) {
+			dcrc_ok = 1;
+			lubi->stats.lebs_known++;
+		} else {
+			uint32_t data_size = __be32_to_cpu(vhdr->data_size);
+
+			// Static LEBs are read up to data_size too
+			dcrc_ok = lubi_crc(lubi, LUBI_CRC_DATA, pnum,
+					   GEO(lubi, data_offs), dst, data_size) ==
+				  __be32_to_cpu(vhdr->data_crc);
+			if (dcrc_ok) {
+				lubi->pebs[i].data_ok_sz = data_size;
+				lubi->stats.lebs_checked++;
+			}
+		}
+
+		if (dcrc_ok) {
+			l2p->peb = i;
+			l2p->dcrc_ok = 1;
+			return len;
+		}
+next:
+		DBG(SGR_BRED "%s: LEB %d: bad data in PEB %d\n",
+		    __func__, lnum, pnum);
+		i = lubi_find_leb(lubi, rd->vol_id, lnum,
+				  __be64_to_cpu(vhdr->sqnum));
+	}
+	return -1;
+}
+
+/**
+ * Whether the data CRC of LEB lnum is to be checked while reading it,
+ * according to the verification policy
+ */
+static int lubi_leb_skip_crc(const struct lubi_priv *lubi,
+			     const struct lubi_rd *rd, uint32_t lnum)
+{
+	const struct ubi_vid_hdr *vhdr;
+
+	if (rd->vol_id == UBI_LAYOUT_VOLUME_ID ||
+	    rd->verify == LUBI_VERIFY_FULL)
+		return 0;
+
+	// Checked by an earlier read, which costs less than trusting it
+	if (lubi_peb_verified(lubi, lubi->scratch->leb2pebs[lnum].peb))
+		return 0;
+
+	// Copies are told apart by their data CRC, the older one being kept
+	// when it fails, so only LEBs written in place are trusted
+	vhdr = &lubi->pebs[lubi->scratch->leb2pebs[lnum].peb].vhdr;
+	if (rd->verify == LUBI_VERIFY_HDR)
+		return !vhdr->copy_flag;
+
+	// Deferred: only as long as the LEB can be recorded for later
+	if (rd->dynamic && !vhdr->copy_flag)
+		return 0;
+
+	return rd->deferred_nb < rd->deferred_max;
+}
+
+static int lubi_fast_fallback(struct lubi_priv *lubi, const struct lubi_rd *rd);
+
+/**
+ * Sets up the read of the volume LEBs in lnum order, run LEB per LEB by
+ * lubi_rd_leb() then completed by lubi_rd_end()
+ */
+static int lubi_rd_begin(struct lubi_priv *lubi, struct lubi_rd *rd)
+{
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	int is_lvl = rd->vol_id == UBI_LAYOUT_VOLUME_ID;
+	int used_ebs;
+
+	// The LEBs handed to leb_fn can't be taken back, should the read
+	// have to start over: the scan of a fast attach is completed first
+	if (rd->leb_fn && !is_lvl && lubi->att_state == ATT_DONE &&
+	    lubi->att_end != GEO(lubi, peb_nb) && lubi_fast_fallback(lubi, rd))
+		return -1;
+
+#ifdef CFG_LUBI_SHA256
+	if (rd->sha256)
+		lubi_sha256_init(&rd->sha256_ctx);
+#else
+	if (rd->sha256)
+		return -1;
+#endif
+
+	if (rd->max_lnum > CFG_LUBI_PEB_NB_MAX - 1)
+		rd->max_lnum = CFG_LUBI_PEB_NB_MAX - 1;
+
+	lubi_map_lebs(lubi, rd->vol_id, rd->max_lnum);
+
+	if (is_lvl) {
+		used_ebs = rd->max_lnum + 1;
+		if (used_ebs > UBI_LAYOUT_VOLUME_EBS)
+			used_ebs = UBI_LAYOUT_VOLUME_EBS;
+	} else if (rd->dynamic) {
+		used_ebs = rd->reserved_lebs;
+	} else if (leb2pebs[0].mapped) {
+		// Pick used_ebs from the most recent copy of LEB 0
+		used_ebs = __be32_to_cpu(lubi->pebs[leb2pebs[0].peb].vhdr.used_ebs);
+	} else {
+		used_ebs = -1;
+	}
+
+	DBG(SGR_BRST "%s: Volume \"%s\"\n\tEBs used: %d\n",
+	    __func__, is_lvl ? UBI_LAYOUT_VOLUME_NAME :
+	    (const char *)lubi->vtbl_recs[rd->vol_id].name, used_ebs);
+
+	if (used_ebs < 1 || (unsigned int)used_ebs - 1 > rd->max_lnum) {
+		DBG(SGR_BRED "%s: Volume read failure (used_ebs %d)\n",
+		    __func__, used_ebs);
+		return -1;
+	}
+
+	rd->used_ebs = used_ebs;
+	rd->lnum = 0;
+	rd->lebs_ok = 0;
+	rd->ret_len = 0;
+	rd->deferred_nb = 0;
+	if (rd->place_fn) {
+		rd->buf = NULL;
+		rd->skip = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads LEB rd->lnum, either in place into rd->buf or through scratch->leb,
+ * and hands it to rd->leb_fn once verified
+ *
+ * Unmapped LEBs of dynamic volumes read as 0xFF, they are passed to
+ * rd->leb_fn with a NULL buffer
+ *
+ * Depending on rd->verify, the data CRCs are checked, trusted or left for
+ * the caller to check with lubi_check_lebs() (rd->deferred)
+ */
+static int lubi_rd_leb(struct lubi_priv *lubi, struct lubi_rd *rd)
+{
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	int is_lvl = rd->vol_id == UBI_LAYOUT_VOLUME_ID;
+	int lnum = rd->lnum++, used_ebs = rd->used_ebs;
+	uint8_t *dst = rd->buf ? rd->buf + lnum * rd->usable_leb_sz - rd->skip :
+				 lubi->scratch->leb;
+	int len, room;
+
+	prefetch_lebs(lubi, rd, lnum, used_ebs);
+
+	// How far past the LEB data a page-aligned read may spill
+	if (!rd->buf)
+		room = sizeof(lubi->scratch->leb);
+	else if (rd->buf_sz)
+		room = rd->buf_sz - lnum * rd->usable_leb_sz;
+	else
+		room = (used_ebs - 1 - lnum + rd->dynamic) *
+		       rd->usable_leb_sz;
+
+	if (rd->dynamic && !leb2pebs[lnum].mapped) {
+		len = rd->usable_leb_sz;
+		if (rd->buf)
+			memset(dst, 0xFF, len);
+		else
+			dst = NULL;
+	} else {
+		int skip_crc = lubi_leb_skip_crc(lubi, rd, lnum);
+
+		const struct ubi_vid_hdr *vhdr;
+
+		len = lubi_read_leb(lubi, rd, lnum, dst, room, skip_crc);
+		vhdr = &lubi->pebs[leb2pebs[lnum].peb].vhdr;
+		if (len < 0 || is_lvl ||
+		    (rd->dynamic && !vhdr->copy_flag) || !skip_crc) {
+			// No data CRC, or accounted by lubi_read_leb()
+		} else if (rd->verify == LUBI_VERIFY_HDR) {
+			lubi->stats.lebs_trusted++;
+		} else {
+			struct lubi_leb_crc *leb =
+				&rd->deferred[rd->deferred_nb++];
+
+			leb->offs = lnum * rd->usable_leb_sz;
+			leb->len = __be32_to_cpu(vhdr->data_size);
+			leb->crc = __be32_to_cpu(vhdr->data_crc);
+			lubi->stats.lebs_deferred++;
+		}
+	}
+
+	if (len < 0) {
+		// Do not return an error in case we could get 1 LEB
+		// from the LVL
+		if (is_lvl)
+			return 0;
+		DBG(SGR_BRED "%s: Volume read failure at LEB %d (read %d bytes)\n",
+		    __func__, lnum, rd->ret_len);
+		return -1;
+	}
+	// All LEBs but the last one are full
+	if (!is_lvl && !rd->dynamic && lnum < used_ebs - 1 &&
+	    len != rd->usable_leb_sz) {
+		DBG(SGR_BRED "%s: LEB %d: expected %d bytes - read %d\n",
+		    __func__, lnum, rd->usable_leb_sz, len);
+		return -1;
+	}
+
+#ifdef CFG_LUBI_SHA256
+	// Digest the data while it's hot, in lnum order
+	if (rd->sha256 && dst) {
+		lubi_sha256_update(&rd->sha256_ctx, dst, len);
+	} else if (rd->sha256) {
+		uint8_t ff[64];
+
+		memset(ff, 0xFF, sizeof(ff));
+		for (int i = 0; i < len; i += sizeof(ff))
+			lubi_sha256_update(&rd->sha256_ctx, ff,
+					   len - i < (int)sizeof(ff) ?
+					   len - i : (int)sizeof(ff));
+	}
+#endif
+
+	if (rd->leb_fn && rd->leb_fn(rd->leb_arg, dst, lnum, len) < 0)
+		return -1;
+
+	// The following LEBs are read in place past what LEB 0 holds beyond
+	// skip, e.g. a uImage header
+	if (!lnum && rd->place_fn) {
+		uint8_t *place = dst ? rd->place_fn(rd->place_arg, dst, len,
+						    &rd->skip) : NULL;
+
+		if (!place || rd->skip < 0 || rd->skip > len) {
+			DBG(SGR_BRED "%s: No placement for LEB 0\n", __func__);
+			return -1;
+		}
+		memcpy(place, dst + rd->skip, len - rd->skip);
+		rd->buf = place;
+	}
+
+	rd->lebs_ok++;
+	rd->ret_len += len;
+
+	return 0;
+}
+
+/**
+ * Completes the read once all the LEBs went through lubi_rd_leb(), returns
+ * the number of bytes read
+ */
+static int lubi_rd_end(struct lubi_priv *lubi, struct lubi_rd *rd)
+{
+	DBG(SGR_BRST "%s: EBs ok: %d - read %d bytes\n", __func__,
+	    rd->lebs_ok, rd->ret_len);
+
+	if (!rd->lebs_ok)
+		return -1;
+
+	if (rd->vol_id != UBI_LAYOUT_VOLUME_ID) {
+		lubi->stats.last_verify = rd->verify;
+		lubi->stats.verify_mask |= 1 << rd->verify;
+	}
+
+#ifdef CFG_LUBI_SHA256
+	if (rd->sha256)
+		lubi_sha256_final(&rd->sha256_ctx, rd->sha256);
+#endif
+
+	return rd->ret_len;
+}
+
+static int lubi_attach_run(struct lubi_priv *lubi, int budget);
+
+/**
+ * Completes the scan of a fast attach which stopped early, after the read
+ * of a volume failed, or before one handing its LEBs to leb_fn: its LEBs
+ * may have newer copies or fallbacks past where it stopped
+ *
+ * Returns 0 if the read is worth running again
+ */
+static int lubi_fast_fallback(struct lubi_priv *lubi, const struct lubi_rd *rd)
+{
+	if (rd->vol_id == UBI_LAYOUT_VOLUME_ID ||
+	    lubi->att_state != ATT_DONE || lubi->att_end == GEO(lubi, peb_nb))
+		return -1;
+
+	DBG(SGR_BRED "%s: Scanning PEBs %d.. after all\n", __func__,
+	    GEO(lubi, peb_min) + lubi->att_end);
+
+	lubi->att_state = ATT_VIDS;
+	lubi->att_next = lubi->att_end;
+	lubi->att_end = GEO(lubi, peb_nb);
+	lubi->stats.pebs_unscanned = 0;
+	lubi->stats.fast_fallbacks++;
+
+	return lubi_attach_run(lubi, BUDGET_ALL);
+}
+
+/**
+ * Reads the volume LEBs in lnum order, c.f. lubi_rd_leb(), traced as a
+ * LUBI_PH_READ_VOL phase
+ */
+static int lubi_read_lebs(struct lubi_priv *lubi, struct lubi_rd *rd)
+{
+	uint64_t ts = trace_start(lubi);
+	int ret;
+
+	// Run again after a fast attach fallback, never with leb_fn set,
+	// c.f. lubi_rd_begin()
+	do {
+		ret = lubi_rd_begin(lubi, rd);
+		while (!ret && rd->lnum < rd->used_ebs)
+			ret = lubi_rd_leb(lubi, rd);
+		if (!ret)
+			ret = lubi_rd_end(lubi, rd);
+	} while (ret < 0 && !lubi_fast_fallback(lubi, rd));
+
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_READ_VOL, ts, rd->vol_id, 0,
+		 ret > 0 ? ret : 0, ret);
+
+	return ret;
+}
+
+/**
+ *
+ */
+static int lubi_init_rd(const struct lubi_priv *lubi, struct lubi_rd *rd,
+			int vol_id, unsigned int max_lnum,
+			__attribute__((unused)) int pad, int any_type)
+{
+#if CFG_LUBI_USE_LVL
+	const struct ubi_vtbl_record *rec;
+#endif
+
+	memset(rd, 0, sizeof(*rd));
+	rd->vol_id = vol_id;
+	rd->max_lnum = max_lnum;
+
+#if CFG_LUBI_USE_LVL
+	if (vol_id == UBI_LAYOUT_VOLUME_ID) {
+		rd->usable_leb_sz = GEO(lubi, leb_sz);
+		return 0;
+	}
+#endif
+	if (lubi->att_state != ATT_DONE)
+		return -1;
+
+#if CFG_LUBI_USE_LVL
+	if (!lubi->vtbl_recs || vol_id < 0 || vol_id >= GEO(lubi, vtbl_slots))
+		return -1;
+
+	rec = &lubi->vtbl_recs[vol_id];
+	if (rec->vol_type == UBI_VID_DYNAMIC && any_type)
+		rd->dynamic = 1;
+	else if (rec->vol_type != UBI_VID_STATIC)
+		return -1;
+
+	rd->usable_leb_sz = GEO(lubi, leb_sz) - __be32_to_cpu(rec->data_pad);
+	rd->reserved_lebs = __be32_to_cpu(rec->reserved_pebs);
+#else
+	if (any_type)
+		return -1;
+	rd->usable_leb_sz = GEO(lubi, leb_sz) - pad;
+#endif
+
+	return 0;
+}
+
+#if CFG_LUBI_USE_LVL
+/**
+ * lubi_init_rd() for any type of volume, with the optional stages of args
+ */
+static int lubi_init_rd_ext(const struct lubi_priv *lubi, struct lubi_rd *rd,
+			    int vol_id, const struct lubi_rd_args *args)
+{
+	if (lubi_init_rd(lubi, rd, vol_id, args->max_lnum, 0, 1))
+		return -1;
+	rd->buf = args->buf;
+	rd->leb_fn = args->leb_fn;
+	rd->leb_arg = args->leb_arg;
+	rd->sha256 = args->sha256;
+	rd->verify = args->verify;
+	rd->deferred = args->deferred;
+	rd->deferred_max = args->deferred ? args->deferred_max : 0;
+	rd->place_fn = args->place_fn;
+	rd->place_arg = args->place_arg;
+
+	if (rd->verify < LUBI_VERIFY_FULL || rd->verify > LUBI_VERIFY_DEFERRED)
+		return -1;
+	// Deferred LEBs are located in buf
+	if (rd->place_fn && (rd->buf || rd->verify == LUBI_VERIFY_DEFERRED))
+		return -1;
+
+	return 0;
+}
+#endif
+
+/**
+ *
+ */
+int lubi_read_svol(void *priv, void *buf, int vol_id, unsigned int max_lnum,
+		   int pad)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd rd;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi_init_rd(lubi, &rd, vol_id, max_lnum, pad, 0))
+		return -1;
+	rd.buf = buf;
+
+	return lubi_read_lebs(lubi, &rd);
+}
+
+/**
+ * Same as lubi_read_svol but hands each LEB to leb_fn, in lnum order, as
+ * soon as it is verified instead of gathering the volume in a buffer
+ */
+int lubi_stream_svol(void *priv, int vol_id, unsigned int max_lnum, int pad,
+		     lubi_leb_fn_t leb_fn, void *arg)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd rd;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi_init_rd(lubi, &rd, vol_id, max_lnum, pad, 0))
+		return -1;
+	rd.leb_fn = leb_fn;
+	rd.leb_arg = arg;
+
+	return lubi_read_lebs(lubi, &rd);
+}
+
+#if CFG_LUBI_USE_LVL
+/**
+ * Same as lubi_read_svol but also accepts dynamic volumes, which are read
+ * whole (reserved_pebs LEBs) and whose unmapped LEBs read as 0xFF
+ */
+int lubi_read_vol(void *priv, void *buf, int vol_id, unsigned int max_lnum)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd rd;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi_init_rd(lubi, &rd, vol_id, max_lnum, 0, 1))
+		return -1;
+	rd.buf = buf;
+
+	return lubi_read_lebs(lubi, &rd);
+}
+
+/**
+ * Same as lubi_stream_svol but also accepts dynamic volumes, leb_fn is
+ * passed a NULL buffer for their unmapped LEBs
+ */
+int lubi_stream_vol(void *priv, int vol_id, unsigned int max_lnum,
+		    lubi_leb_fn_t leb_fn, void *arg)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd rd;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi_init_rd(lubi, &rd, vol_id, max_lnum, 0, 1))
+		return -1;
+	rd.leb_fn = leb_fn;
+	rd.leb_arg = arg;
+
+	return lubi_read_lebs(lubi, &rd);
+}
+
+/**
+ * Reads a static or dynamic volume according to args, which are those of
+ * lubi_read_vol() / lubi_stream_vol() plus the optional stages
+ *
+ * With args->place_fn, LEB 0 is read through scratch->leb and, once checked,
+ * handed to it: it returns where the volume data past its first *skip
+ * bytes goes, the LEBs that follow being read straight there
+ */
+int lubi_read_vol_ext(void *priv, int vol_id, const struct lubi_rd_args *args)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd rd;
+	int ret;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi_init_rd_ext(lubi, &rd, vol_id, args))
+		return -1;
+
+	ret = lubi_read_lebs(lubi, &rd);
+	if (args->deferred_nb)
+		*args->deferred_nb = rd.deferred_nb;
+
+	return ret;
+}
+
+/**
+ * Starts a read to be run by lubi_read_step(), with the arguments of
+ * lubi_read_vol_ext()
+ *
+ * Until it is over, the lubi instance must not be used for anything else
+ * but lubi_get_stats(), another attach cancels it
+ */
+int lubi_read_start(void *priv, int vol_id, const struct lubi_rd_args *args)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd *rd = &lubi->step_rd;
+
+	DBG_FUNC_ENTRY();
+
+	lubi->step_active = 0;
+	if (lubi_init_rd_ext(lubi, rd, vol_id, args) ||
+	    lubi_rd_begin(lubi, rd))
+		return -1;
+	lubi->step_deferred_nb = args->deferred_nb;
+	lubi->step_active = 1;
+
+	return 0;
+}
+
+/**
+ * Time-sliced read: goes on with the read lubi_read_start() set up, reading
+ * up to budget (> 0) LEBs
+ *
+ * Returns 1 while the read is under way, 0 once complete with *len set to
+ * the number of bytes read, -1 on failure
+ */
+int lubi_read_step(void *priv, int budget, int *len)
+{
+	struct lubi_priv *lubi = priv;
+	struct lubi_rd *rd = &lubi->step_rd;
+	uint64_t ts = trace_start(lubi);
+	int ret = 0;
+
+	if (!lubi->step_active)
+		return -1;
+
+	for (; budget > 0 && rd->lnum < rd->used_ebs && !ret; budget--)
+		ret = lubi_rd_leb(lubi, rd);
+
+	if (!ret && rd->lnum == rd->used_ebs) {
+		*len = lubi_rd_end(lubi, rd);
+		ret = *len < 0 ? -1 : 0;
+	} else if (!ret) {
+		ret = 1;
+	}
+	// Started over once the fast attach scan is complete
+	if (ret < 0 && !lubi_fast_fallback(lubi, rd))
+		ret = lubi_rd_begin(lubi, rd) ? -1 : 1;
+
+	if (ret <= 0) {
+		lubi->step_active = 0;
+		if (lubi->step_deferred_nb)
+			*lubi->step_deferred_nb = rd->deferred_nb;
+	}
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_READ_VOL, ts, rd->vol_id, 0,
+		 rd->ret_len, ret);
+
+	return ret;
+}
+#endif
+
+/**
+ * Checks the data CRCs of the LEBs left unchecked by a LUBI_VERIFY_DEFERRED
+ * read, buf being the volume as read then
+ *
+ * Doesn't need the lubi instance, e.g. to be run later or by another thread
+ */
+int lubi_check_lebs(const void *buf, const struct lubi_leb_crc *lebs, int nb)
+{
+	for (int i = 0; i < nb; i++) {
+		if (crc32((const uint8_t *)buf + lebs[i].offs, lebs[i].len) !=
+		    lebs[i].crc) {
+			DBG(SGR_BRED "%s: bad data @ %u\n", __func__,
+			    lebs[i].offs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *
+ */
+const struct lubi_stats *lubi_get_stats(const void *priv)
+{
+	const struct lubi_priv *lubi = priv;
+
+	return &lubi->stats;
+}
+
+#if CFG_LUBI_USE_LVL
+/**
+ *
+ */
+int lubi_list_vols(const void *priv)
+{
+	const struct lubi_priv *lubi = priv;
+	struct ubi_vtbl_record *recs = lubi->vtbl_recs;
+
+	DBG_FUNC_ENTRY();
+
+	if (!recs)
+		return -1;
+
+	for (int i = 0; i < GEO(lubi, vtbl_slots); i++)
+		if (recs[i].name_len)
+			DBG(SGR_BRST "\tfound %40s: upd_marker:%d type:%s\n",
+			    recs[i].name, recs[i].upd_marker,
+			    recs[i].vol_type == UBI_VID_STATIC ?
+			    "static" : "dynamic");
+
+	return 0;
+}
+
+/**
+ *
+ */
+int lubi_get_vol_id(const void *priv, const char *name, int *upd_marker)
+{
+	const struct lubi_priv *lubi = priv;
+	struct ubi_vtbl_record *recs = lubi->vtbl_recs;
+	size_t len;
+
+	DBG_FUNC_ENTRY();
+
+	if (!recs)
+		return -1;
+
+	len = strlen(name); // strnlen(name, UBI_VOL_NAME_MAX + 1) if available
+
+	if (!len || len > UBI_VOL_NAME_MAX)
+		return -1;
+
+	len = __cpu_to_be16(len);
+	for (int i = 0; i < GEO(lubi, vtbl_slots); i++) {
+#if 0 // ATM liblubi doesn't accept damaged LVLs so the following can't happen
+		if (crc32(&recs[i], UBI_VTBL_RECORD_SIZE_CRC) !=
+		    __be32_to_cpu(recs[i].crc)) {
+			DBG(SGR_BRED "%s: Bad VTBL rec\n", __func__);
+			continue;
+		}
+#endif
+		if (len == recs[i].name_len &&
+		    !strcmp((const char *)recs[i].name, name)) {
+			*upd_marker = recs[i].upd_marker;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Fills info for the volume slot vol_id, info->name is NULL if the slot is
+ * empty, returns -1 past the last slot
+ */
+int lubi_get_vol_info(const void *priv, int vol_id, struct lubi_vol_info *info)
+{
+	const struct lubi_priv *lubi = priv;
+	const struct ubi_vtbl_record *rec;
+
+	if (!lubi->vtbl_recs || vol_id < 0 || vol_id >= GEO(lubi, vtbl_slots))
+		return -1;
+
+	rec = &lubi->vtbl_recs[vol_id];
+	memset(info, 0, sizeof(*info));
+	if (!rec->name_len)
+		return 0;
+
+	info->name = (const char *)rec->name;
+	info->dynamic = rec->vol_type == UBI_VID_DYNAMIC;
+	info->upd_marker = rec->upd_marker;
+	info->reserved_lebs = __be32_to_cpu(rec->reserved_pebs);
+	info->leb_sz = GEO(lubi, leb_sz) - __be32_to_cpu(rec->data_pad);
+
+	return 0;
+}
+
+/**
+ * Rates a static volume from the attach metadata only, without reading any
+ * data: 2 if all of its used_ebs LEBs are mapped, 1 if so but its update
+ * was interrupted, 0 if LEBs are missing and -1 if it can't be read at all
+ *
+ * *sqnum is set to the most recent sqnum among its LEBs
+ */
+static int lubi_rate_svol(struct lubi_priv *lubi, int vol_id, uint64_t *sqnum)
+{
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	int used_ebs, lebs = 0;
+
+	*sqnum = 0;
+
+	if (vol_id < 0 || vol_id >= GEO(lubi, vtbl_slots) ||
+	    lubi->vtbl_recs[vol_id].vol_type != UBI_VID_STATIC)
+		return -1;
+
+	lubi_map_lebs(lubi, vol_id, CFG_LUBI_PEB_NB_MAX - 1);
+
+	if (!leb2pebs[0].mapped)
+		return -1;
+
+	used_ebs = __be32_to_cpu(lubi->pebs[leb2pebs[0].peb].vhdr.used_ebs);
+
+	for (int lnum = 0; lnum < used_ebs && lnum < CFG_LUBI_PEB_NB_MAX;
+	     lnum++) {
+		uint64_t leb_sqnum;
+
+		if (!leb2pebs[lnum].mapped)
+			continue;
+
+		lebs++;
+		leb_sqnum = __be64_to_cpu(lubi->pebs[leb2pebs[lnum].peb].vhdr.sqnum);
+		if (leb_sqnum > *sqnum)
+			*sqnum = leb_sqnum;
+	}
+
+	// Nothing to read, or more LEBs than a read takes
+	if (used_ebs < 1 || lebs != used_ebs)
+		return 0;
+
+	return lubi->vtbl_recs[vol_id].upd_marker ? 1 : 2;
+}
+
+/**
+ * Ranks the candidate static volumes vol_ids[0..nb) (e.g. A/B banks) from
+ * the attach metadata only: complete volumes first, then those not being
+ * updated, then the most recent ones
+ *
+ * order[] gets the candidate indexes, best first, so that only the best one
+ * need be read, the next ones being fallbacks in case of CRC failure
+ */
+int lubi_rank_svols(void *priv, const int *vol_ids, int *order, int nb)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	if (!lubi->vtbl_recs)
+		return -1;
+
+	for (int i = 0; i < nb; i++)
+		order[i] = i;
+
+	// Selection sort, there are only a few candidates
+	for (int i = 0; i < nb; i++) {
+		int best = i, best_rate = -2;
+		uint64_t best_sqnum = 0;
+
+		for (int j = i; j < nb; j++) {
+			uint64_t sqnum;
+			int rate = lubi_rate_svol(lubi, vol_ids[order[j]], &sqnum);
+
+			if (rate > best_rate ||
+			    (rate == best_rate && sqnum > best_sqnum)) {
+				best = j;
+				best_rate = rate;
+				best_sqnum = sqnum;
+			}
+		}
+
+		if (best != i) {
+			int tmp = order[i];
+
+			order[i] = order[best];
+			order[best] = tmp;
+		}
+
+		DBG(SGR_BRST "\t#%d: vol_id %d rate %d sqnum %lld\n", i,
+		    vol_ids[order[i]], best_rate, (long long)best_sqnum);
+	}
+
+	return 0;
+}
+
+/**
+ * Reads the best of the candidate static volumes vol_ids[0..nb) according
+ * to lubi_rank_svols(), only falling back to the next one on read failure;
+ * up to CFG_LUBI_CANDIDATES_MAX of them, lubi_rank_svols() ranking any
+ * number into the caller's order[]
+ *
+ * *picked is set to the index of the candidate which was read
+ */
+int lubi_read_best_svol(void *priv, void *buf, const int *vol_ids, int nb,
+			unsigned int max_lnum, int *picked)
+{
+	int order[CFG_LUBI_CANDIDATES_MAX];
+
+	DBG_FUNC_ENTRY();
+
+	if (nb > CFG_LUBI_CANDIDATES_MAX) {
+		DBG(SGR_BRED "%s: %d candidates > %d\n", __func__, nb,
+		    CFG_LUBI_CANDIDATES_MAX);
+		return -1;
+	}
+
+	if (lubi_rank_svols(priv, vol_ids, order, nb))
+		return -1;
+
+	for (int i = 0; i < nb; i++) {
+		int len = lubi_read_svol(priv, buf, vol_ids[order[i]], max_lnum, 0);
+
+		if (len >= 0) {
+			*picked = order[i];
+			return len;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Fingerprints a static volume from the attach metadata alone: its vtbl
+ * record and the VID headers of its LEBs, data_{crc,size} and sqnum
+ *
+ * As a LEB can't be rewritten without a new sqnum, a volume whose
+ * fingerprint did not change still holds the same data
+ *
+ * Dynamic volumes can't be fingerprinted: their LEBs may be appended to
+ * without new VID headers
+ */
+int lubi_vol_fp(void *priv, int vol_id, struct lubi_vol_fp *fp)
+{
+	struct lubi_priv *lubi = priv;
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	const struct ubi_vtbl_record *rec;
+	struct {
+		uint32_t crc;
+		uint32_t lnum;
+		uint32_t data_size;
+		uint32_t data_crc;
+		uint64_t sqnum;
+	} leb;
+	int used_ebs;
+
+	DBG_FUNC_ENTRY();
+
+	if (!lubi->vtbl_recs || vol_id < 0 || vol_id >= GEO(lubi, vtbl_slots))
+		return -1;
+
+	rec = &lubi->vtbl_recs[vol_id];
+	if (rec->vol_type != UBI_VID_STATIC || rec->upd_marker)
+		return -1;
+
+	lubi_map_lebs(lubi, vol_id, CFG_LUBI_PEB_NB_MAX - 1);
+	if (!leb2pebs[0].mapped)
+		return -1;
+
+	used_ebs = __be32_to_cpu(lubi->pebs[leb2pebs[0].peb].vhdr.used_ebs);
+	if (used_ebs < 1 || used_ebs > CFG_LUBI_PEB_NB_MAX)
+		return -1;
+
+	fp->sqnum = 0;
+	fp->lebs = used_ebs;
+	fp->crc = rec->crc ^ __cpu_to_be32(vol_id);
+
+	// Chained over the LEBs, in lnum order
+	for (int lnum = 0; lnum < used_ebs; lnum++) {
+		const struct ubi_vid_hdr *vhdr;
+
+		if (!leb2pebs[lnum].mapped)
+			return -1;
+
+		vhdr = &lubi->pebs[leb2pebs[lnum].peb].vhdr;
+		memset(&leb, 0, sizeof(leb));
+		leb.crc = fp->crc;
+		leb.lnum = vhdr->lnum;
+		leb.data_size = vhdr->data_size;
+		leb.data_crc = vhdr->data_crc;
+		leb.sqnum = vhdr->sqnum;
+		fp->crc = crc32(&leb, sizeof(leb));
+
+		if (__be64_to_cpu(vhdr->sqnum) > fp->sqnum)
+			fp->sqnum = __be64_to_cpu(vhdr->sqnum);
+	}
+
+	return 0;
+}
+
+/**
+ * Bytes a read of vol_id returns, from the attach metadata alone, e.g. to
+ * size its destination beforehand: the used_ebs LEBs of a static volume,
+ * the last one holding its data_size, all the reserved LEBs of a dynamic
+ * one; -1 if the static volume misses LEBs
+ */
+int lubi_vol_size(void *priv, int vol_id)
+{
+	struct lubi_priv *lubi = priv;
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	const struct ubi_vtbl_record *rec;
+	const struct ubi_vid_hdr *last;
+	int used_ebs, leb_sz;
+
+	DBG_FUNC_ENTRY();
+
+	if (!lubi->vtbl_recs || vol_id < 0 || vol_id >= GEO(lubi, vtbl_slots))
+		return -1;
+
+	rec = &lubi->vtbl_recs[vol_id];
+	if (!rec->name_len)
+		return -1;
+
+	leb_sz = GEO(lubi, leb_sz) - __be32_to_cpu(rec->data_pad);
+	if (rec->vol_type == UBI_VID_DYNAMIC)
+		return __be32_to_cpu(rec->reserved_pebs) * leb_sz;
+
+	lubi_map_lebs(lubi, vol_id, CFG_LUBI_PEB_NB_MAX - 1);
+	if (!leb2pebs[0].mapped)
+		return -1;
+
+	used_ebs = __be32_to_cpu(lubi->pebs[leb2pebs[0].peb].vhdr.used_ebs);
+	if (used_ebs < 1 || used_ebs > CFG_LUBI_PEB_NB_MAX ||
+	    !leb2pebs[used_ebs - 1].mapped)
+		return -1;
+
+	last = &lubi->pebs[leb2pebs[used_ebs - 1].peb].vhdr;
+
+	return (used_ebs - 1) * leb_sz + __be32_to_cpu(last->data_size);
+}
+#endif
+
+#if CFG_LUBI_USE_LVL
+/**
+ * Reads the layout volume and points vtbl_recs to a good copy of the vtbl
+ */
+static int lubi_read_lvl(struct lubi_priv *lubi)
+{
+	struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	struct lubi_rd rd;
+
+	lubi->vtbl_recs = NULL;
+
+	lubi_init_rd(lubi, &rd, UBI_LAYOUT_VOLUME_ID, 1, 0, 0);
+	rd.buf = lubi->vtbls_buf;
+	rd.buf_sz = sizeof(lubi->vtbls_buf);
+	if (lubi_read_lebs(lubi, &rd) < 0)
+		return -1;
+
+	for (int i = 0; i < 2; i++)
+		DBG("LVL: LEB[%1d] -> PEB[%3d] - data crc: %s\n",
+		    i, GEO(lubi, peb_min) + lubi->pebs[leb2pebs[i].peb].idx,
+		    leb2pebs[i].dcrc_ok ? "good" : "bad");
+
+	if (leb2pebs[0].dcrc_ok)
+		lubi->vtbl_recs = (void *)&lubi->vtbls_buf[0];
+	else if (leb2pebs[1].dcrc_ok)
+		lubi->vtbl_recs = (void *)&lubi->vtbls_buf[GEO(lubi, leb_sz)];
+	else
+		return -1;
+
+	return 0;
+}
+#endif
+
+/**
+ * Re-reads the VID header of PEB index i, returns 1 if it held or now holds
+ * a LEB of the layout volume, -1 when out of records
+ */
+static int lubi_rescan_peb(struct lubi_priv *lubi, int i)
+{
+	const struct peb_rec *peb = &lubi->scratch->recs[0];
+	int r, lvl = 0;
+
+	for (r = lubi->recs_nb - 1; r >= 0 && lubi->pebs[r].idx != i; r--)
+		;
+	if (r >= 0)
+		lvl = lubi->pebs[r].vhdr.vol_id ==
+		      __cpu_to_be32(UBI_LAYOUT_VOLUME_ID);
+
+	if (lubi_add_peb(lubi, i, r))
+		return -1;
+
+	return lvl || (peb->vhdr_crc_ok &&
+		       peb->vhdr.vol_id == __cpu_to_be32(UBI_LAYOUT_VOLUME_ID));
+}
+
+/**
+ * Incremental attach: only re-reads the headers of the nb PEBs pnums[]
+ * known to have changed since lubi_attach(), and the layout volume if one
+ * of its LEBs was touched
+ *
+ * LEB to PEB mappings are resolved at read time from the PEB table so
+ * nothing else needs updating
+ */
+int lubi_reattach_pebs(void *priv, const int *pnums, int nb)
+{
+	struct lubi_priv *lubi = priv;
+	int lvl = 0;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi->att_state != ATT_DONE)
+		return -1;
+
+	for (int j = 0; j < nb; j++) {
+		int i = pnums[j] - GEO(lubi, peb_min), ret;
+
+		if (i < 0 || i >= GEO(lubi, peb_nb) ||
+		    (ret = lubi_rescan_peb(lubi, i)) < 0)
+			return -1;
+		lvl |= ret;
+	}
+
+#if CFG_LUBI_USE_LVL
+	if (lvl)
+		return lubi_read_lvl(lubi);
+#endif
+
+	return 0;
+}
+
+/**
+ * Same as lubi_reattach_pebs() for the nb PEBs starting at pnum
+ */
+int lubi_reattach_range(void *priv, int pnum, int nb)
+{
+	struct lubi_priv *lubi = priv;
+	int lvl = 0;
+
+	DBG_FUNC_ENTRY();
+
+	if (lubi->att_state != ATT_DONE || pnum < GEO(lubi, peb_min) || nb < 0 ||
+	    pnum - GEO(lubi, peb_min) + nb > GEO(lubi, peb_nb))
+		return -1;
+
+	for (int i = pnum - GEO(lubi, peb_min); nb--; i++) {
+		int ret = lubi_rescan_peb(lubi, i);
+
+		if (ret < 0)
+			return -1;
+		lvl |= ret;
+	}
+
+#if CFG_LUBI_USE_LVL
+	if (lvl)
+		return lubi_read_lvl(lubi);
+#endif
+
+	return 0;
+}
+
+/**
+ * lubi_scan_ecs() / lubi_scan_vids() traced as a LUBI_PH_SCAN_* phase
+ */
+#ifndef CFG_LUBI_FIXED_GEO
+static int lubi_trace_scan_ecs(struct lubi_priv *lubi, uint32_t vhdr_offs,
+			       int from, int to)
+{
+	uint64_t ts = trace_start(lubi);
+	int ret = lubi_scan_ecs(lubi, vhdr_offs, from, to);
+
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_SCAN_ECS, ts, -1, 0, 0, ret);
+
+	return ret;
+}
+
+static void lubi_set_leb_sz(struct lubi_priv *lubi)
+{
+	lubi->leb_sz = lubi->peb_sz - lubi->data_offs;
+	lubi->vtbl_slots = lubi->leb_sz / UBI_VTBL_RECORD_SIZE;
+	if (lubi->vtbl_slots > UBI_MAX_VOLUMES)
+		lubi->vtbl_slots = UBI_MAX_VOLUMES;
+}
+#endif
+
+static int lubi_trace_scan_vids(struct lubi_priv *lubi, int others_only,
+				int from, int to)
+{
+	uint64_t ts = trace_start(lubi);
+	int ret = lubi_scan_vids(lubi, others_only, from, to);
+
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_SCAN_VIDS, ts, -1, 0, 0, ret);
+
+	return ret;
+}
+
+#if CFG_LUBI_USE_LVL
+/**
+ * Adds the vol_ids of the targets given by name, now that the layout volume
+ * was read
+ */
+static void lubi_resolve_targets(struct lubi_priv *lubi)
+{
+	for (int t = 0; t < lubi->att_nb; t++) {
+		const char *name = lubi->att_targets[t].name;
+		int vol_id, upd_marker;
+
+		if (!name)
+			continue;
+		vol_id = lubi_get_vol_id(lubi, name, &upd_marker);
+		if (vol_id < 0) {
+			DBG(SGR_BRED "%s: no volume \"%s\"\n", __func__, name);
+			continue;
+		}
+		lubi->targets[lubi->targets_nb++] = vol_id;
+	}
+	lubi->att_targets = NULL;
+}
+#endif
+
+/**
+ * Whether all the LEBs of the static volume, up to the used_ebs of the
+ * most recent copy of its LEB 0, or both LEBs of the layout volume, have
+ * a record
+ */
+static int lubi_vol_complete(struct lubi_priv *lubi, int vol_id)
+{
+	const struct leb2peb *leb2pebs = lubi->scratch->leb2pebs;
+	const struct ubi_vid_hdr *vhdr;
+	uint32_t used_ebs;
+
+	lubi_map_lebs(lubi, vol_id, 0);
+	if (!leb2pebs[0].mapped)
+		return 0;
+
+	vhdr = &lubi->pebs[leb2pebs[0].peb].vhdr;
+	if (vol_id == UBI_LAYOUT_VOLUME_ID)
+		used_ebs = UBI_LAYOUT_VOLUME_EBS;
+	else if (vhdr->vol_type == UBI_VID_STATIC)
+		used_ebs = __be32_to_cpu(vhdr->used_ebs);
+	else
+		return 0;
+	if (!used_ebs || used_ebs > CFG_LUBI_PEB_NB_MAX)
+		return 0;
+
+	lubi_map_lebs(lubi, vol_id, used_ebs - 1);
+	for (uint32_t lnum = 1; lnum < used_ebs; lnum++)
+		if (!leb2pebs[lnum].mapped)
+			return 0;
+
+	return 1;
+}
+
+/**
+ * Fast attach, checked along the VID scan: once the layout volume is
+ * complete, has it read to resolve the targets given by name, then once
+ * the targets are complete too, ends the scan fast_window PEBs further
+ */
+static void lubi_fast_check(struct lubi_priv *lubi)
+{
+	int stop;
+
+	if (!lubi_vol_complete(lubi, UBI_LAYOUT_VOLUME_ID))
+		return;
+
+#if CFG_LUBI_USE_LVL
+	if (lubi->att_targets) {
+		lubi->att_resume = lubi->att_next;
+		lubi->att_state = ATT_LVL;
+		return;
+	}
+#endif
+
+	for (int t = 0; t < lubi->targets_nb; t++)
+		if (!lubi_vol_complete(lubi, lubi->targets[t]))
+			return;
+
+	lubi->att_fast = 0;
+	stop = lubi->att_next + lubi->fast_window;
+	if (stop >= lubi->att_end)
+		return;
+
+	DBG("%s: Targets complete at PEB %d, stopping at %d\n", __func__,
+	    GEO(lubi, peb_min) + lubi->att_next, GEO(lubi, peb_min) + stop);
+	lubi->stats.pebs_unscanned = lubi->att_end - stop;
+	lubi->att_end = stop;
+}
+
+/**
+ * Runs the attach from where it stopped, reading up to budget PEB headers,
+ * the layout volume counting as UBI_LAYOUT_VOLUME_EBS of them
+ *
+ * Returns 1 if there is more to do, 0 once attached, -1 on failure
+ */
+static int lubi_attach_run(struct lubi_priv *lubi, int budget)
+{
+	while (budget > 0 && lubi->att_state != ATT_DONE) {
+		int from = lubi->att_next, peb_nb = GEO(lubi, peb_nb), end, to;
+		int cost;
+
+		if (lubi->att_state == ATT_VIDS)
+			end = lubi->att_end;
+		else if (lubi->att_state == ATT_OTHERS && lubi->att_resume)
+			end = lubi->att_resume;
+		else
+			end = peb_nb;
+		to = end - from < budget ? end : from + budget;
+		if (lubi->att_state == ATT_VIDS && lubi->att_fast &&
+		    to - from > FAST_STEP)
+			to = from + FAST_STEP;
+		cost = to - from;
+
+		switch (lubi->att_state) {
+#ifndef CFG_LUBI_FIXED_GEO
+		case ATT_ECS: {
+			int i = lubi_trace_scan_ecs(lubi, lubi->att_vhdr_offs,
+						    from, to);
+
+			if (i >= 0) {
+				lubi_set_leb_sz(lubi);
+				lubi->att_state = ATT_VIDS;
+				lubi->att_next = 0;
+				cost = i + 1 - from;
+			} else if (to == peb_nb) {
+				goto fail;
+			} else {
+				lubi->att_next = to;
+			}
+			break;
+		}
+#endif
+		case ATT_VIDS:
+			if (lubi_trace_scan_vids(lubi, 0, from, to))
+				goto fail;
+			lubi->att_next = to;
+			if (lubi->att_fast)
+				lubi_fast_check(lubi);
+			if (lubi->att_state != ATT_VIDS || to < lubi->att_end)
+				break;
+			lubi->att_next = 0;
+			lubi->att_state = CFG_LUBI_USE_LVL ? ATT_LVL : ATT_DONE;
+			break;
+		case ATT_OTHERS:
+			if (lubi_trace_scan_vids(lubi, 1, from, to))
+				goto fail;
+			lubi->att_next = to;
+			if (to < end)
+				break;
+			// Back to the VID scan lubi_fast_check() interrupted
+			lubi->att_next = lubi->att_resume;
+			lubi->att_state = lubi->att_resume ? ATT_VIDS : ATT_DONE;
+			lubi->att_resume = 0;
+			break;
+#if CFG_LUBI_USE_LVL
+		case ATT_LVL:
+			if (lubi_read_lvl(lubi))
+				goto fail;
+			lubi->att_state = lubi->att_targets ? ATT_OTHERS : ATT_DONE;
+			if (lubi->att_targets)
+				lubi_resolve_targets(lubi);
+			lubi->att_next = 0;
+			cost = UBI_LAYOUT_VOLUME_EBS;
+			break;
+#endif
+		default:
+			return -1;
+		}
+		budget -= cost;
+	}
+
+	return lubi->att_state != ATT_DONE;
+fail:
+	lubi->att_state = ATT_NONE;
+	return -1;
+}
+
+/**
+ * Starts an attach to be run by lubi_attach_step(), with the arguments of
+ * lubi_attach_vols(); targets given by name must stay valid until the
+ * layout volume is read
+ */
+int lubi_attach_start(void *priv, uint32_t vhdr_offs, uint32_t data_offs,
+		      const struct lubi_target *targets, int nb)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	memset(lubi->scan_mem_start, 0,
+	       __builtin_offsetof(struct lubi_priv, scan_mem_end) -
+	       __builtin_offsetof(struct lubi_priv , scan_mem_start));
+
+	if (nb < 0 || nb > CFG_LUBI_TARGETS_MAX)
+		return -1;
+
+#ifdef CFG_LUBI_FIXED_GEO
+	(void)vhdr_offs;
+	(void)data_offs;
+#else
+	if (!vhdr_offs || !data_offs) {
+		// if vhdr_offs == 0, data_offs is not used
+		lubi->att_vhdr_offs = vhdr_offs;
+		lubi->att_state = ATT_ECS;
+	} else {
+		lubi->vhdr_offs = vhdr_offs;
+		lubi->data_offs = data_offs;
+		lubi_set_leb_sz(lubi);
+	}
+#endif
+	if (lubi->att_state != ATT_ECS)
+		lubi->att_state = ATT_VIDS;
+	lubi->att_end = GEO(lubi, peb_nb);
+	lubi->att_fast = nb > 0 && lubi->fast_window >= 0;
+
+	lubi->targeted = nb > 0;
+	for (int t = 0; t < nb; t++) {
+		if (targets[t].name)
+			lubi->att_targets = targets;
+		else
+			lubi->targets[lubi->targets_nb++] = targets[t].vol_id;
+	}
+	lubi->att_nb = nb;
+#if !CFG_LUBI_USE_LVL
+	if (lubi->att_targets) {
+		lubi->att_state = ATT_NONE;
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * Time-sliced attach: goes on with the attach lubi_attach_start() set up,
+ * reading up to budget (> 0) PEB headers, so that a bootloader can overlap
+ * it with other slow init, e.g.
+ *
+ *	lubi_attach_start(ubi_priv, 0, 0, NULL, 0);
+ *	while ((ret = lubi_attach_step(ubi_priv, 64)) > 0)
+ *		other_init_step();
+ *
+ * Returns 1 while the attach is under way, 0 once attached, -1 on failure;
+ * the volumes can't be read until it returned 0
+ */
+int lubi_attach_step(void *priv, int budget)
+{
+	struct lubi_priv *lubi = priv;
+	uint64_t ts = trace_start(lubi);
+	int ret = lubi_attach_run(lubi, budget);
+
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_ATTACH, ts, -1, 0, 0, ret);
+
+	return ret;
+}
+
+/**
+ * Targeted attach: only keeps the records of the PEBs holding LEBs of the
+ * layout volume and of the nb targets, the other PEBs only take a bit, so
+ * that CFG_LUBI_RECS_MAX can be sized after the boot volumes rather than
+ * after the device
+ *
+ * Targets given by name are resolved once the layout volume is read, the
+ * PEBs left out until then get their VID header read a second time, names
+ * not found are skipped
+ *
+ * The other volumes can't be read until the next lubi_attach(), a reattach
+ * keeps the same targets
+ *
+ * With nb == 0, same as lubi_attach()
+ */
+int lubi_attach_vols(void *priv, uint32_t vhdr_offs, uint32_t data_offs,
+		     const struct lubi_target *targets, int nb)
+{
+	struct lubi_priv *lubi = priv;
+	uint64_t ts;
+	int ret;
+
+	DBG_FUNC_ENTRY();
+
+	ts = trace_start(lubi);
+	ret = lubi_attach_start(lubi, vhdr_offs, data_offs, targets, nb);
+	if (!ret)
+		ret = lubi_attach_run(lubi, BUDGET_ALL);
+	trace_ev(lubi, LUBI_EV_PHASE, LUBI_PH_ATTACH, ts, -1, 0, 0, ret);
+
+	return ret;
+}
+
+/**
+ * Fast attach, for the targeted attaches to come: the VID scan stops window
+ * PEBs past the point where the layout volume and all the targets are
+ * complete, i.e. each LEB of the static targets up to used_ebs was seen,
+ * the window catching newer copies of their LEBs written further
+ *
+ * Should the read of a volume then fail, the scan is completed and the
+ * read run again, once; dynamic targets can't be told complete, they get
+ * a full scan
+ *
+ * window < 0 restores full scans
+ */
+int lubi_set_fast_attach(void *priv, int window)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	lubi->fast_window = window < 0 ? -1 : window;
+
+	return 0;
+}
+
+/**
+ * With CFG_LUBI_FIXED_GEO, vhdr_offs and data_offs are ignored and no EC
+ * header is read
+ */
+int lubi_attach(void *priv, uint32_t vhdr_offs, uint32_t data_offs)
+{
+	return lubi_attach_vols(priv, vhdr_offs, data_offs, NULL, 0);
+}
+
+/**
+ * Attaches all the partitions of a lubi_init_parts() context in flash
+ * order, so that the scan goes through the device once
+ *
+ * Returns -1 if one of them failed, the others can still be used
+ */
+int lubi_attach_parts(void *priv, uint32_t vhdr_offs, uint32_t data_offs)
+{
+	const struct lubi_priv *lubi = priv;
+	int peb_min = -1, ret = 0;
+
+	DBG_FUNC_ENTRY();
+
+	for (int k = 0; k < lubi->parts_nb; k++) {
+		struct lubi_priv *next = NULL;
+
+		for (int i = 0; i < lubi->parts_nb; i++) {
+			struct lubi_priv *part = lubi_part(priv, i);
+
+			if (GEO(part, peb_min) > peb_min &&
+			    (!next || GEO(part, peb_min) < GEO(next, peb_min)))
+				next = part;
+		}
+		if (!next)
+			break;
+		peb_min = GEO(next, peb_min);
+		if (lubi_attach(next, vhdr_offs, data_offs)) {
+			DBG(SGR_BRED "%s: PEBs %d..: attach failed\n", __func__,
+			    peb_min);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Declares the flash I/O contract: from then on flash_read is only called
+ * with page_sz aligned offsets and lengths, into dma_align aligned buffers
+ *
+ * priv must be aligned on dma_align, which can't exceed CFG_LUBI_IO_ALIGN
+ */
+int lubi_set_io_align(void *priv, int page_sz, int dma_align)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	if (!dma_align)
+		dma_align = 1;
+
+	if (page_sz <= 0 || page_sz & (page_sz - 1) ||
+	    page_sz > CFG_LUBI_PAGE_SZ_MAX) {
+		DBG("page_sz arg = %d > %d\n", page_sz, CFG_LUBI_PAGE_SZ_MAX);
+		return -1;
+	}
+	if (dma_align < 0 || dma_align & (dma_align - 1) ||
+	    dma_align > CFG_LUBI_IO_ALIGN ||
+	    (uintptr_t)priv & (dma_align - 1)) {
+		DBG("dma_align arg = %d > %d\n", dma_align, CFG_LUBI_IO_ALIGN);
+		return -1;
+	}
+
+	lubi->io_page_sz = page_sz;
+	lubi->io_align = dma_align;
+
+	return 0;
+}
+
+/**
+ * Announces the flash reads to come, up to ahead of them in advance, to a
+ * flash_read backend able to keep several of them in flight, e.g. while
+ * scanning the PEB headers or reading the LEBs of a volume
+ *
+ * The announced reads are only hints: they may never be issued, e.g. when
+ * the scan stops early, and flash_read may be called for reads that were
+ * not announced, e.g. on fallback to an older copy of a LEB
+ */
+int lubi_set_prefetch(void *priv, lubi_prefetch_fn_t prefetch, int ahead)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	if (prefetch && ahead < 1)
+		return -1;
+
+	lubi->ext_prefetch = prefetch;
+	lubi->prefetch_ahead = ahead;
+
+	return 0;
+}
+
+/**
+ * Lets the attach scan skip the PEBs is_bad() reports, e.g. from the bad
+ * block markers in their OOB
+ */
+int lubi_set_bad_peb(void *priv, lubi_bad_peb_fn_t is_bad)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	lubi->ext_is_bad = is_bad;
+
+	return 0;
+}
+
+/**
+ * Records the flash reads, CRCs and phases from then on into the trace ring,
+ * emptied, timestamped by clock(ext_priv) in units of the caller's choosing,
+ * e.g. ns or timer ticks; NULL stops recording
+ *
+ * Returns -1 if built without the trace ring (CFG_LUBI_TRACE_NB)
+ */
+int lubi_set_trace(void *priv, lubi_clock_fn_t clock)
+{
+#if CFG_LUBI_TRACE_NB
 	struct lubi_priv *lubi = priv;
 
 	DBG_FUNC_ENTRY();
 
+	lubi->ext_clock = clock;
+	lubi->scratch->trace_nb = 0;
+
+	return 0;
+#else
+	(void)priv;
+	(void)clock;
+	return -1;
+#endif
+}
+
+/**
+ * Copies up to nb of the last traced events into evs, oldest first, and
+ * returns how many; returns how many are held if evs is NULL
+ *
+ * *lost, if lost is set, gets the number of events overwritten since
+ * lubi_set_trace()
+ */
+int lubi_get_trace(const void *priv, struct lubi_trace_ev *evs, int nb,
+		   unsigned int *lost)
+{
+#if CFG_LUBI_TRACE_NB
+	const struct lubi_priv *lubi = priv;
+	unsigned int held = lubi->scratch->trace_nb < CFG_LUBI_TRACE_NB ?
+			    lubi->scratch->trace_nb : CFG_LUBI_TRACE_NB;
+	unsigned int first;
+
+	if (lost)
+		*lost = lubi->scratch->trace_nb - held;
+	if (!evs)
+		return held;
+
+	if (nb < 0)
+		return -1;
+	if ((unsigned int)nb > held)
+		nb = held;
+	first = lubi->scratch->trace_nb - nb;
+	for (int i = 0; i < nb; i++)
+		evs[i] = lubi->scratch->trace[(first + i) % CFG_LUBI_TRACE_NB];
+
+	return nb;
+#else
+	(void)priv;
+	(void)evs;
+	(void)nb;
+	if (lost)
+		*lost = 0;
+	return -1;
+#endif
+}
+
+/**
+ *
+ */
+int lubi_mem_sz(void)
+{
+	return sizeof(struct lubi_priv);
+}
+
+/**
+ * Size of a lubi_init_parts() context of nb partitions
+ */
+int lubi_parts_mem_sz(int nb)
+{
+	return sizeof(struct lubi_priv) + (nb - 1) * PART_SZ;
+}
+
+static int lubi_init_part(struct lubi_priv *lubi, struct lubi_scratch *scratch,
+			  void *ext_priv, flash_read_fn_t flash_read,
+			  int peb_sz, int peb_min, int peb_nb)
+{
 	lubi->ext_priv = ext_priv;
 	lubi->ext_flash_read = flash_read;
+	lubi->ext_prefetch = NULL;
+	lubi->prefetch_ahead = 0;
+	lubi->ext_is_bad = NULL;
+	lubi->scratch = scratch;
+	lubi->parts_nb = 1;
+#if CFG_LUBI_TRACE_NB
+	lubi->ext_clock = NULL;
+	lubi->scratch->trace_nb = 0;
+#endif
+	lubi->fast_window = -1;
+	lubi->io_page_sz = 0;
+	lubi->io_align = 1;
+
+#ifdef CFG_LUBI_FIXED_GEO
+	if (peb_sz != CFG_LUBI_PEB_SZ || peb_min != CFG_LUBI_PEB_MIN ||
+	    peb_nb != CFG_LUBI_PEB_NB) {
+		DBG("geometry args %d/%d/%d != %d/%d/%d\n", peb_sz, peb_min,
+		    peb_nb, CFG_LUBI_PEB_SZ, CFG_LUBI_PEB_MIN, CFG_LUBI_PEB_NB);
+		return -1;
+	}
+#else
 	lubi->peb_sz = peb_sz;
 	lubi->peb_min = peb_min;
 	lubi->peb_nb = peb_nb;
@@ -418,6 +2378,86 @@ int lubi_init(void *priv, void *ext_priv, flash_read_fn_t flash_read,
 		DBG("peb_nb arg = %d > %d\n", lubi->peb_sz, CFG_LUBI_PEB_SZ_MAX);
 		return -1;
 	}
+#endif
+
+	return 0;
+}
+
+// Partition part of a lubi_init_parts() context, unchecked
+static struct lubi_priv *part_priv(void *priv, int part)
+{
+	return part ? (void *)((uint8_t *)priv + sizeof(struct lubi_priv) +
+			       (part - 1) * PART_SZ) : priv;
+}
+
+/**
+ *
+ */
+int lubi_init(void *priv, void *ext_priv, flash_read_fn_t flash_read,
+	      int peb_sz, int peb_min, int peb_nb)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	return lubi_init_part(lubi, &lubi->own_scratch, ext_priv, flash_read,
+			      peb_sz, peb_min, peb_nb);
+}
+
+/**
+ * Several UBI partitions of the same flash in one context of
+ * lubi_parts_mem_sz(nb) bytes: each of the nb ranges parts[] gets its own
+ * PEB table and volume table, the scratch memory (LEB and page buffers,
+ * trace ring) is that of the first one
+ *
+ * Partition i is then used through lubi_part(priv, i) with the rest of the
+ * API, settings included, e.g. to read a volume by (partition, name), but
+ * one at a time: a time-sliced attach or read must be over before another
+ * partition is used
+ */
+int lubi_init_parts(void *priv, void *ext_priv, flash_read_fn_t flash_read,
+		    int peb_sz, const struct lubi_part *parts, int nb)
+{
+	struct lubi_priv *lubi = priv;
+
+	DBG_FUNC_ENTRY();
+
+	if (nb < 1)
+		return -1;
+
+	for (int i = 0; i < nb; i++) {
+		if (parts[i].peb_min < 0 || parts[i].peb_nb < 1) {
+			DBG("partition %d: bad PEB range\n", i);
+			return -1;
+		}
+		for (int j = 0; j < i; j++)
+			if (parts[i].peb_min < parts[j].peb_min + parts[j].peb_nb &&
+			    parts[j].peb_min < parts[i].peb_min + parts[i].peb_nb) {
+				DBG("partitions %d and %d overlap\n", j, i);
+				return -1;
+			}
+	}
+
+	for (int i = 0; i < nb; i++)
+		if (lubi_init_part(part_priv(priv, i), &lubi->own_scratch,
+				   ext_priv, flash_read, peb_sz,
+				   parts[i].peb_min, parts[i].peb_nb))
+			return -1;
+	lubi->parts_nb = nb;
 
 	return 0;
 }
+
+/**
+ * Partition part of a lubi_init_parts() context, NULL if there is none;
+ * the handle of a partition but the first one only holds itself
+ */
+void *lubi_part(void *priv, int part)
+{
+	const struct lubi_priv *lubi = priv;
+
+	if (part < 0 || part >= lubi->parts_nb)
+		return NULL;
+
+	return part_priv(priv, part);
+}
@@ -8,14 +8,159 @@
 #define __LIBLUBI_H__
 
 typedef int (*flash_read_fn_t)(void *priv, void *dst, int pnum, int offset, int len);
+typedef int (*lubi_leb_fn_t)(void *arg, const void *buf, unsigned int lnum, int len);
+typedef void (*lubi_prefetch_fn_t)(void *priv, int pnum, int offset, int len);
+typedef int (*lubi_bad_peb_fn_t)(void *priv, int pnum);
+typedef uint64_t (*lubi_clock_fn_t)(void *priv);
+typedef void *(*lubi_place_fn_t)(void *arg, const void *leb0, int len, int *skip);
+
+#define LUBI_SHA256_SZ		32
+
+// Data verification policies
+enum {
+	LUBI_VERIFY_FULL,		// check the data CRCs
+	LUBI_VERIFY_HDR,		// trust the VID headers CRCs and data_size
+	LUBI_VERIFY_DEFERRED,		// leave the data CRCs to lubi_check_lebs()
+};
+
+// LEB data CRC left to check, offs is relative to the volume
+struct lubi_leb_crc {
+	uint32_t offs;
+	uint32_t len;
+	uint32_t crc;
+};
+
+struct lubi_rd_args {
+	void *buf;			// read in place if set
+	lubi_leb_fn_t leb_fn;		// called for each LEB in lnum order
+	void *leb_arg;
+	unsigned int max_lnum;
+	uint8_t *sha256;		// LUBI_SHA256_SZ digest of the data read
+	int verify;			// LUBI_VERIFY_*
+	struct lubi_leb_crc *deferred;	// LEBs left to check when deferred
+	int deferred_max;		// beyond that many, LEBs are checked
+	int *deferred_nb;
+	lubi_place_fn_t place_fn;	// destination picked from LEB 0, buf unset
+	void *place_arg;
+};
+
+struct lubi_vol_info {
+	const char *name;		// NULL for an empty slot
+	int dynamic;
+	int upd_marker;
+	int reserved_lebs;
+	int leb_sz;			// usable, i.e. without data_pad
+};
+
+// Identifies the contents of a static volume, c.f. lubi_vol_fp()
+struct lubi_vol_fp {
+	uint64_t sqnum;			// most recent LEB
+	uint32_t lebs;
+	uint32_t crc;			// vtbl record and VID headers
+};
+
+struct lubi_stats {
+	unsigned int flash_reads;
+	unsigned long long flash_bytes;
+	unsigned int lebs_checked;	// data CRC checked
+	unsigned int lebs_known;	// data CRC checked by an earlier read
+	unsigned int lebs_trusted;	// LUBI_VERIFY_HDR
+	unsigned int lebs_deferred;	// LUBI_VERIFY_DEFERRED
+	int last_verify;		// policy of the last volume read
+	unsigned int verify_mask;	// policies used since attach
+	unsigned int bad_pebs;		// skipped by the attach scan
+	unsigned int pebs_unscanned;	// left out by a fast attach
+	unsigned int fast_fallbacks;	// fast attach scans completed after all
+	unsigned int pebs_kept;		// attach records in use
+};
+
+// Volume of interest of a targeted attach, by name if set, else by vol_id
+struct lubi_target {
+	const char *name;
+	int vol_id;
+};
+
+// Trace events, c.f. lubi_set_trace()
+enum {
+	LUBI_EV_READ,			// flash_read call
+	LUBI_EV_CRC,			// id is the LUBI_CRC_* checked
+	LUBI_EV_PHASE,			// id is the LUBI_PH_*
+};
+
+enum {
+	LUBI_CRC_EC_HDR,
+	LUBI_CRC_VID_HDR,
+	LUBI_CRC_VTBL,			// all the records of a vtbl copy
+	LUBI_CRC_DATA,
+};
+
+enum {
+	LUBI_PH_ATTACH,
+	LUBI_PH_SCAN_ECS,
+	LUBI_PH_SCAN_VIDS,
+	LUBI_PH_READ_VOL,		// pnum is the vol_id
+};
+
+// UBI partition of the device, for lubi_init_parts()
+struct lubi_part {
+	int peb_min;
+	int peb_nb;
+};
+
+// Times are in units of the clock hook, ts being the start of the event
+struct lubi_trace_ev {
+	uint64_t ts;
+	uint64_t dur;
+	uint8_t type;			// LUBI_EV_*
+	uint8_t id;
+	int32_t pnum;			// -1 if none
+	uint32_t offset;
+	uint32_t len;
+	int32_t ret;			// flash_read or phase return value
+};
 
 int lubi_read_svol(void *priv, void *buf, int vol_id, unsigned int max_lnum,
 		   int pad);
+int lubi_stream_svol(void *priv, int vol_id, unsigned int max_lnum, int pad,
+		     lubi_leb_fn_t leb_fn, void *arg);
+int lubi_read_vol(void *priv, void *buf, int vol_id, unsigned int max_lnum);
+int lubi_stream_vol(void *priv, int vol_id, unsigned int max_lnum,
+		    lubi_leb_fn_t leb_fn, void *arg);
+int lubi_read_vol_ext(void *priv, int vol_id, const struct lubi_rd_args *args);
+int lubi_read_start(void *priv, int vol_id, const struct lubi_rd_args *args);
+int lubi_read_step(void *priv, int budget, int *len);
+int lubi_check_lebs(const void *buf, const struct lubi_leb_crc *lebs, int nb);
+const struct lubi_stats *lubi_get_stats(const void *priv);
 int lubi_list_vols(const void *priv);
 int lubi_get_vol_id(const void *priv, const char *name, int *upd_marker);
+int lubi_get_vol_info(const void *priv, int vol_id, struct lubi_vol_info *info);
+int lubi_vol_fp(void *priv, int vol_id, struct lubi_vol_fp *fp);
+int lubi_vol_size(void *priv, int vol_id);
+int lubi_rank_svols(void *priv, const int *vol_ids, int *order, int nb);
+int lubi_read_best_svol(void *priv, void *buf, const int *vol_ids, int nb,
+			unsigned int max_lnum, int *picked);
 int lubi_attach(void *priv, uint32_t vhdr_offs, uint32_t data_offs);
+int lubi_attach_parts(void *priv, uint32_t vhdr_offs, uint32_t data_offs);
+int lubi_attach_vols(void *priv, uint32_t vhdr_offs, uint32_t data_offs,
+		     const struct lubi_target *targets, int nb);
+int lubi_attach_start(void *priv, uint32_t vhdr_offs, uint32_t data_offs,
+		      const struct lubi_target *targets, int nb);
+int lubi_attach_step(void *priv, int budget);
+int lubi_reattach_pebs(void *priv, const int *pnums, int nb);
+int lubi_reattach_range(void *priv, int pnum, int nb);
+int lubi_set_io_align(void *priv, int page_sz, int dma_align);
+int lubi_set_prefetch(void *priv, lubi_prefetch_fn_t prefetch, int ahead);
+int lubi_set_bad_peb(void *priv, lubi_bad_peb_fn_t is_bad);
+int lubi_set_fast_attach(void *priv, int window);
+int lubi_set_trace(void *priv, lubi_clock_fn_t clock);
+int lubi_get_trace(const void *priv, struct lubi_trace_ev *evs, int nb,
+		   unsigned int *lost);
 int lubi_mem_sz(void);
+int lubi_parts_mem_sz(int nb);
 int lubi_init(void *priv, void *ext_priv, flash_read_fn_t flash_read,
 	      int peb_sz, int peb_min, int peb_nb);
+int lubi_init_parts(void *priv, void *ext_priv, flash_read_fn_t flash_read,
+		    int peb_sz, const struct lubi_part *parts, int nb);
+void *lubi_part(void *priv, int part);
 
 #endif /* !__LIBLUBI_H__ */
@@ -10,13 +10,33 @@
 #ifdef __UBOOT__
 #include <common.h>
 
+#ifdef CONFIG_SPL_LUBI_FIXED_GEO
+#define CFG_LUBI_FIXED_GEO
+#define CFG_LUBI_PEB_SZ		CONFIG_SPL_LUBI_PEB_SZ
+#define CFG_LUBI_PEB_MIN	CONFIG_SPL_LUBI_PEB_MIN
+#define CFG_LUBI_PEB_NB		CONFIG_SPL_LUBI_PEB_NB
+#define CFG_LUBI_VHDR_OFFS	CONFIG_SPL_LUBI_VHDR_OFFS
+#define CFG_LUBI_DATA_OFFS	CONFIG_SPL_LUBI_DATA_OFFS
+#else
 #define CFG_LUBI_PEB_NB_MAX	CONFIG_SPL_LUBI_PEB_NB_MAX
 #define CFG_LUBI_PEB_SZ_MAX	CONFIG_SPL_LUBI_PEB_SZ_MAX
+#endif
+#ifdef CONFIG_SPL_LUBI_RECS_MAX
+#define CFG_LUBI_RECS_MAX	CONFIG_SPL_LUBI_RECS_MAX
+#endif
+#ifdef CONFIG_SPL_LUBI_TRACE_NB
+#define CFG_LUBI_TRACE_NB	CONFIG_SPL_LUBI_TRACE_NB
+#endif
 #define CFG_LUBI_INT_CRC32
 #define CFG_LUBI_USE_LVL	CONFIG_SPL_LUBI_USE_LVL
+#define CFG_LUBI_PAGE_SZ_MAX	CONFIG_SYS_NAND_PAGE_SIZE
+#define CFG_LUBI_IO_ALIGN	ARCH_DMA_MINALIGN
 #ifdef CONFIG_SPL_LUBI_DBG
 #define CFG_LUBI_DBG
 #endif
+#ifdef CONFIG_SPL_LUBI_SHA256
+#define CFG_LUBI_SHA256
+#endif
 
 #ifdef CFG_LUBI_DBG
 #include <asm/global_data.h>
@@ -36,8 +56,42 @@ DECLARE_GLOBAL_DATA_PTR;
 #ifndef CFG_LUBI_USE_LVL
 #define CFG_LUBI_USE_LVL	1
 #endif
+#ifndef CFG_LUBI_PAGE_SZ_MAX
+#define CFG_LUBI_PAGE_SZ_MAX	4096
+#endif
+#ifndef CFG_LUBI_IO_ALIGN
+#define CFG_LUBI_IO_ALIGN	64
+#endif
 #endif // __UBOOT__
 
+// Fixed geometry: the sizes and offsets are compile-time constants and the
+// buffers are sized after them
+#ifdef CFG_LUBI_FIXED_GEO
+#undef CFG_LUBI_PEB_NB_MAX
+#undef CFG_LUBI_PEB_SZ_MAX
+#define CFG_LUBI_PEB_NB_MAX	CFG_LUBI_PEB_NB
+#define CFG_LUBI_PEB_SZ_MAX	CFG_LUBI_PEB_SZ
+#endif
+
+#ifndef CFG_LUBI_CANDIDATES_MAX
+#define CFG_LUBI_CANDIDATES_MAX	4
+#endif
+
+// Attach records, one per PEB holding a LEB of a volume of interest, c.f.
+// lubi_attach_vols(): lower it to the PEBs of the boot volumes to shrink
+// lubi_priv on large devices
+#ifndef CFG_LUBI_RECS_MAX
+#define CFG_LUBI_RECS_MAX	CFG_LUBI_PEB_NB_MAX
+#endif
+#ifndef CFG_LUBI_TARGETS_MAX
+#define CFG_LUBI_TARGETS_MAX	4
+#endif
+
+// Events held by the trace ring, c.f. lubi_set_trace(), 0 leaves it out
+#ifndef CFG_LUBI_TRACE_NB
+#define CFG_LUBI_TRACE_NB	0
+#endif
+
 #ifdef CFG_LUBI_DBG
 #ifndef __UBOOT__
 #include <stdio.h>
@@ -62,10 +116,23 @@ DECLARE_GLOBAL_DATA_PTR;
 #define CRCPOLY_LE		0xEDB88320
 #define crc32(buf, len)		crc32_le(UBI_CRC32_INIT, (const uint8_t *)(buf), len, CRCPOLY_LE)
 extern uint32_t crc32_le(uint32_t crc, const uint8_t *p, size_t len, uint32_t poly);
+#define crc32_multi(bufs, len, crcs, nb)	\
+	crc32_le_multi(UBI_CRC32_INIT, bufs, len, CRCPOLY_LE, crcs, nb)
+extern void crc32_le_multi(uint32_t crc, const uint8_t *const p[], size_t len,
+			   uint32_t poly, uint32_t crcs[], int nb);
 #else
 #include <u-boot/crc.h>
 #define crc32(buf, len)		crc32_no_comp(~0, (unsigned char const *)(buf), len)
 #endif
 #endif
 
+// CRCs of nb buffers of len bytes each, one at a time unless the CRC
+// implementation has lanes
+#ifndef crc32_multi
+#define crc32_multi(bufs, len, crcs, nb)	do {			\
+		for (int i_ = 0; i_ < (nb); i_++)			\
+			(crcs)[i_] = crc32((bufs)[i_], len);		\
+	} while (0)
+#endif
+
 #endif /* !__LUBI_H__ */
@@ -4,16 +4,16 @@
  *
  * SPDX-License-Identifier: GPL-2.0+
  */
-#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
-
 #include <sys/mman.h>
+#include <fcntl.h>
 
 #include <unistd.h>
 #include <string.h>
@@ -22,23 +22,1375 @@
 #include <err.h>
 
 #include <libgen.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
+#include "liblubi_cfg.h"
 #include "liblubi.h"
+#include "flash_io.h"
+#include "decomp.h"
+#include "nand_sim.h"
+#include "daemon.h"
 #include "config.h"
 
 #define handle_error(str) \
 	do { err(-1, "%d: %s", __LINE__, str); } while (0)
 
+#define IO_ALIGN	64
+#define VOL_CANDIDATES_MAX	8
+#define PARTS_MAX		8
+
+// How a volume read whole goes to its output file
+enum {
+	OUT_WRITE,			// read to memory, then written out
+	OUT_MMAP,			// read straight into the mapped file
+	OUT_MMAP_HUGE,			// same, with huge pages if possible
+};
+#define QD_DEFAULT	32
+
 struct data {
-	char *addr;
+	struct fio fio;
 	int peb_sz;
+	int io_page_sz;
+	struct nand_sim *sim;		// timing model, NULL if none
 };
 
 static int flash_read(void *priv, void *dst, int pnum, int offset, int len)
 {
 	struct data *data = (struct data *)priv;
-        memcpy(dst, data->addr + data->peb_sz * pnum + offset, len);
-        return len;
+
+	// Check the contract a DMA-capable controller would rely on
+	if (data->io_page_sz &&
+	    (offset % data->io_page_sz || len % data->io_page_sz ||
+	     (uintptr_t)dst % IO_ALIGN))
+		errx(-1, "unaligned read: PEB %d offset %d len %d dst %p",
+		     pnum, offset, len, dst);
+
+	if (data->sim)
+		nand_sim_read(data->sim, pnum, offset, len);
+
+	return fio_read(&data->fio, dst, pnum, offset, len);
+}
+
+static void prefetch(void *priv, int pnum, int offset, int len)
+{
+	struct data *data = (struct data *)priv;
+
+	fio_prefetch(&data->fio, pnum, offset, len);
+}
+
+static int is_bad(void *priv, int pnum)
+{
+	struct data *data = (struct data *)priv;
+
+	return fio_peb_bad(&data->fio, pnum);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct out {
+	int fd;
+	int tty;
+	int seekable;
+	int sparse;
+	off_t off;
+	unsigned char *ff;
+	int ff_len;
+	uint8_t *map;			// OUT_MMAP*: the file, map_sz bytes
+	size_t map_sz;
+};
+
+static void dump_hex(const unsigned char *buf, int len, off_t off)
+{
+	for (int i = 0; i < len; i++) {
+		if (!((off + i) % 4) && off + i)
+			putchar((off + i) % 16 ? ' ' : '\n');
+		printf("%02x ", buf[i]);
+	}
+}
+
+static int out_write(struct out *out, const void *buf, int len)
+{
+	const char *p = buf;
+
+	// Unmapped LEB
+	if (!buf) {
+		if (out->sparse && out->seekable) {
+			out->off += len;
+			return 0;
+		}
+		if (out->ff_len < len) {
+			if (!(out->ff = realloc(out->ff, len)))
+				return -1;
+			memset(out->ff, 0xFF, len);
+			out->ff_len = len;
+		}
+		p = buf = out->ff;
+	}
+
+	if (out->tty) {
+		dump_hex(buf, len, out->off);
+		out->off += len;
+		return 0;
+	}
+
+	while (len) {
+		ssize_t w = out->seekable ? pwrite(out->fd, p, len, out->off) :
+					    write(out->fd, p, len);
+		if (w < 0)
+			return -1;
+		p += w;
+		len -= w;
+		out->off += w;
+	}
+	return 0;
+}
+
+static void out_open(struct out *out, const char *path, int map)
+{
+	struct stat st;
+
+	if (!strcmp(path, "-")) {
+		out->fd = fileno(stdout);
+	} else {
+		// Shared writable mappings need the file readable too, pipes
+		// must not be, lest a gone reader goes unnoticed
+		int rw = map && (stat(path, &st) || S_ISREG(st.st_mode));
+
+		out->fd = open(path, (rw ? O_RDWR : O_WRONLY) | O_TRUNC |
+			       O_CREAT, 0644);
+		if (out->fd == -1)
+			handle_error(path);
+	}
+	out->tty = isatty(out->fd);
+	out->seekable = !fstat(out->fd, &st) && S_ISREG(st.st_mode);
+	out->off = 0;
+}
+
+static void out_unmap(struct out *out)
+{
+	if (out->map && munmap(out->map, out->map_sz))
+		warn("munmap");
+	out->map = NULL;
+	out->map_sz = 0;
+}
+
+/**
+ * Sizes the regular file out->fd to sz bytes and maps it shared, so that
+ * the volume is read straight into its page cache pages rather than to
+ * memory then copied by write(); NULL if it can't be, e.g. a pipe, a tty
+ * or a 0 sz, the file being emptied anyway
+ */
+static uint8_t *out_map(struct out *out, size_t sz, int huge)
+{
+	int ret;
+
+	out_unmap(out);
+	if (!out->seekable || out->tty)
+		return NULL;
+
+	// Nothing left of a previous candidate
+	if (ftruncate(out->fd, 0)) {
+		warn("ftruncate");
+		return NULL;
+	}
+	if (!sz)
+		return NULL;
+
+	// Blocks allocated up front: no ENOSPC as SIGBUS halfway through
+	if ((ret = posix_fallocate(out->fd, 0, sz))) {
+		errno = ret;
+		warn("fallocate");
+		return NULL;
+	}
+	out->map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+	if (out->map == MAP_FAILED) {
+		warn("mmap");
+		out->map = NULL;
+		if (ftruncate(out->fd, 0))
+			warn("ftruncate");
+		return NULL;
+	}
+	out->map_sz = sz;
+#ifdef MADV_HUGEPAGE
+	// Only honored by some filesystems, e.g. tmpfs mounted huge=
+	if (huge && madvise(out->map, sz, MADV_HUGEPAGE))
+		warn("madvise");
+#else
+	(void)huge;
+#endif
+
+	return out->map;
+}
+
+static int stream_leb(void *arg, const void *buf,
+		      __attribute__((unused)) unsigned int lnum, int len)
+{
+	if (out_write(arg, buf, len)) {
+		warn("write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Decompression pipeline: the LEBs are queued, as lubi checks them, to a
+ * decoder thread which writes out the decompressed volume, so that reading,
+ * decompressing and writing overlap; each stage is timed apart
+ */
+#define PIPE_SLOTS	8
+
+struct pipe {
+	int type;
+	struct out *out;		// NULL to only check the stream
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *slots[PIPE_SLOTS];
+	int lens[PIPE_SLOTS];
+	int slot_sz;			// LEBs can't be larger than PEBs
+	unsigned int head, tail;	// queued LEBs: [head, tail)
+	int held;			// slot head is being decoded
+	int eof;
+	int done;			// decoder returned ret
+	int ret;
+
+	// busy time of each stage, waits on the queue excluded
+	double t0, read_s, dec_s, write_s, wait_s;
+	unsigned long long in_bytes, out_bytes;
+};
+
+static const uint8_t *pipe_in(void *arg, size_t *len)
+{
+	struct pipe *p = arg;
+	double t0 = now();
+	const uint8_t *buf = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->held) {
+		p->head++;
+		p->held = 0;
+		pthread_cond_broadcast(&p->cond);
+	}
+	while (p->head == p->tail && !p->eof)
+		pthread_cond_wait(&p->cond, &p->lock);
+	*len = 0;
+	if (p->head != p->tail) {
+		buf = p->slots[p->head % PIPE_SLOTS];
+		*len = p->lens[p->head % PIPE_SLOTS];
+		p->held = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	p->wait_s += now() - t0;
+
+	return buf;
+}
+
+static int pipe_out(void *arg, const void *buf, size_t len)
+{
+	struct pipe *p = arg;
+	double t0 = now();
+	int ret = 0;
+
+	p->out_bytes += len;
+	for (size_t off = 0; p->out && off < len && !ret; off += 1 << 30)
+		ret = out_write(p->out, (const char *)buf + off,
+				len - off < 1 << 30 ? len - off : 1 << 30);
+	if (ret)
+		warn("write");
+	p->write_s += now() - t0;
+
+	return ret;
+}
+
+static void *pipe_thread(void *arg)
+{
+	struct pipe *p = arg;
+	struct dec_io io = { pipe_in, pipe_out, p };
+	double t0 = now();
+	int ret = dec_run(p->type, &io);
+
+	p->dec_s = now() - t0 - p->wait_s - p->write_s;
+
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	p->ret = ret;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/**
+ * leb_fn queueing the LEBs to the decoder, what follows the compressed
+ * stream is dropped
+ */
+static int pipe_leb(void *arg, const void *buf,
+		    __attribute__((unused)) unsigned int lnum, int len)
+{
+	struct pipe *p = arg;
+	double t0 = now();
+	uint8_t *slot = p->slots[p->tail % PIPE_SLOTS];
+	int done, ret;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->tail - p->head == PIPE_SLOTS && !p->done)
+		pthread_cond_wait(&p->cond, &p->lock);
+	done = p->done;
+	ret = p->ret;
+	pthread_mutex_unlock(&p->lock);
+	p->read_s -= now() - t0;
+
+	if (done)
+		return ret;
+	if (len > p->slot_sz)
+		return -1;
+	// Unmapped LEB
+	if (buf)
+		memcpy(slot, buf, len);
+	else
+		memset(slot, 0xFF, len);
+	p->in_bytes += len;
+
+	pthread_mutex_lock(&p->lock);
+	p->lens[p->tail % PIPE_SLOTS] = len;
+	p->tail++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+static void pipe_start(struct pipe *p, int type, struct out *out, int slot_sz)
+{
+	p->type = type;
+	p->out = out;
+	p->slot_sz = slot_sz;
+	p->head = p->tail = 0;
+	p->held = p->eof = p->done = p->ret = 0;
+	p->read_s = p->dec_s = p->write_s = p->wait_s = 0;
+	p->in_bytes = p->out_bytes = 0;
+	for (int i = 0; i < PIPE_SLOTS; i++)
+		if (!p->slots[i] && !(p->slots[i] = malloc(slot_sz)))
+			handle_error("malloc");
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->t0 = now();
+	if (pthread_create(&p->thread, NULL, pipe_thread, p))
+		errx(-1, "pthread_create");
+}
+
+/**
+ * Waits for the decoder to be done with the LEBs queued, returns -1 if it
+ * failed or if the stream is truncated
+ */
+static int pipe_finish(struct pipe *p)
+{
+	p->read_s += now() - p->t0;
+
+	pthread_mutex_lock(&p->lock);
+	p->eof = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+
+	return p->ret;
+}
+
+static void pipe_free(struct pipe *p)
+{
+	for (int i = 0; i < PIPE_SLOTS; i++)
+		free(p->slots[i]);
+}
+
+static double mb_s(unsigned long long bytes, double s)
+{
+	return s > 0 ? bytes / s / 1e6 : 0;
+}
+
+// Fingerprint of the volume an output file was extracted from, c.f.
+// lubi_vol_fp(), along with the size and mtime of the file then
+#define CACHE_SUFFIX	".lubi-fp"
+#define CACHE_FMT	"lubi-fp 1 %d %llu %u %x %lld %lld.%ld %64s\n"
+
+struct ctx {
+	void *lubi_priv;
+	unsigned char *buf;		// whole volume, unless streaming
+	size_t buf_sz;			// of buf, allocated on first use
+	struct lubi_leb_crc *deferred;
+	unsigned int max_lnum;
+	int stream;
+	int sparse;
+	int sha256;
+	int verify;
+	int force;
+	int quiet;
+	int decomp;			// DEC_*, streaming
+	int out_io;			// OUT_*, unless streaming
+	int peb_sz;
+	int steps;			// LEBs per lubi_read_step(), 0 for one go
+
+	// outcome of extract()
+	const char *name;		// candidate picked
+	int len;
+	int cached;
+	uint8_t digest[LUBI_SHA256_SZ];
+};
+
+static void print_sha256(const uint8_t *sha256, const char *name)
+{
+	for (int i = 0; i < LUBI_SHA256_SZ; i++)
+		fprintf(stderr, "%02x", sha256[i]);
+	fprintf(stderr, "  %s\n", name);
+}
+
+/**
+ * Returns the size of opath if it was extracted from vol_id as it is now,
+ * -1 otherwise; sha256 is filled if it was recorded
+ */
+static int cache_lookup(void *lubi_priv, const char *opath, int vol_id,
+			uint8_t *sha256)
+{
+	char path[PATH_MAX], hex[2 * LUBI_SHA256_SZ + 1];
+	struct lubi_vol_fp fp, cfp;
+	long long size, mtime_s;
+	long mtime_ns;
+	struct stat st;
+	int cvol_id, n;
+	unsigned long long sqnum;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s" CACHE_SUFFIX, opath) >=
+	    (int)sizeof(path) || !(f = fopen(path, "r")))
+		return -1;
+	n = fscanf(f, CACHE_FMT, &cvol_id, &sqnum, &cfp.lebs, &cfp.crc, &size,
+		   &mtime_s, &mtime_ns, hex);
+	fclose(f);
+	if (n != 8)
+		return -1;
+
+	if (lubi_vol_fp(lubi_priv, vol_id, &fp) || cvol_id != vol_id ||
+	    sqnum != fp.sqnum || cfp.lebs != fp.lebs || cfp.crc != fp.crc)
+		return -1;
+
+	// The output file must not have been touched since
+	if (stat(opath, &st) || !S_ISREG(st.st_mode) || st.st_size != size ||
+	    st.st_mtim.tv_sec != mtime_s || st.st_mtim.tv_nsec != mtime_ns)
+		return -1;
+
+	if (sha256) {
+		if (strlen(hex) != 2 * LUBI_SHA256_SZ)
+			return -1;
+		for (int i = 0; i < LUBI_SHA256_SZ; i++)
+			if (sscanf(hex + 2 * i, "%2hhx", &sha256[i]) != 1)
+				return -1;
+	}
+
+	return size;
+}
+
+/**
+ * Records the fingerprint of vol_id for opath, or drops the stale one if
+ * the volume can't be fingerprinted
+ */
+static void cache_store(void *lubi_priv, const char *opath, int vol_id,
+			const uint8_t *sha256)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct lubi_vol_fp fp;
+	struct stat st;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s" CACHE_SUFFIX, opath) >=
+	    (int)sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+
+	if (lubi_vol_fp(lubi_priv, vol_id, &fp) || stat(opath, &st) ||
+	    !S_ISREG(st.st_mode)) {
+		unlink(path);
+		return;
+	}
+
+	if (!(f = fopen(tmp, "w"))) {
+		warn("%s", tmp);
+		return;
+	}
+	fprintf(f, "lubi-fp 1 %d %llu %u %x %lld %lld.%09ld ", vol_id,
+		(unsigned long long)fp.sqnum, fp.lebs, fp.crc,
+		(long long)st.st_size, (long long)st.st_mtim.tv_sec,
+		st.st_mtim.tv_nsec);
+	if (sha256)
+		for (int i = 0; i < LUBI_SHA256_SZ; i++)
+			fprintf(f, "%02x", sha256[i]);
+	else
+		fprintf(f, "-");
+	fprintf(f, "\n");
+	if (fclose(f) || rename(tmp, path))
+		warn("%s", path);
+}
+
+#define MSG(ctx, ...) \
+	do { if (!(ctx)->quiet) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/**
+ * lubi_read_vol_ext(), sliced into ctx->steps LEBs at a time as a bootloader
+ * would do to overlap it with other init
+ */
+static int read_vol(struct ctx *ctx, int vol_id,
+		    const struct lubi_rd_args *args)
+{
+	int ret, len = -1, steps = 1;
+
+	if (!ctx->steps)
+		return lubi_read_vol_ext(ctx->lubi_priv, vol_id, args);
+
+	if (lubi_read_start(ctx->lubi_priv, vol_id, args))
+		return -1;
+	while ((ret = lubi_read_step(ctx->lubi_priv, ctx->steps, &len)) > 0)
+		steps++;
+	MSG(ctx, "read: %d steps of up to %d LEBs\n", steps, ctx->steps);
+
+	return ret ? -1 : len;
+}
+
+/**
+ * Extracts the best of the nb candidate volumes to opath, unless opath
+ * already holds it; with a NULL opath, the volume is only read and checked
+ */
+static int extract(struct ctx *ctx, const char **vol_names, const int *vol_ids,
+		   int nb_vols, const char *opath)
+{
+	struct out out = { 0 };
+	struct pipe pipe = { 0 };
+	struct lubi_rd_args rd_args = { 0 };
+	uint8_t *sha256 = ctx->digest;
+	int order[VOL_CANDIDATES_MAX];
+	int deferred_nb = 0, len, vol_id = -1;
+	const char *name = NULL;
+	int cache = opath && strcmp(opath, "-");
+	int map = cache && ctx->out_io != OUT_WRITE && !ctx->stream &&
+		  !ctx->decomp;
+
+	ctx->name = vol_names[0];
+	ctx->len = -1;
+	ctx->cached = 0;
+
+	if (lubi_rank_svols(ctx->lubi_priv, vol_ids, order, nb_vols)) {
+		MSG(ctx, "%s:%d: lubi_rank_svols failed\n", __func__, __LINE__);
+		return -1;
+	}
+
+	// Nothing to read if the output is still that of the best candidate,
+	// the fingerprint being that of the volume as is
+	if (cache && !ctx->force && !ctx->decomp &&
+	    (len = cache_lookup(ctx->lubi_priv, opath, vol_ids[order[0]],
+				ctx->sha256 ? sha256 : NULL)) >= 0) {
+		ctx->name = name = vol_names[order[0]];
+		ctx->len = len;
+		ctx->cached = 1;
+		MSG(ctx, "Volume \"%s\" unchanged (%d bytes), skipped\n",
+		    name, len);
+		if (ctx->sha256 && !ctx->quiet)
+			print_sha256(sha256, name);
+		return 0;
+	}
+
+	if ((ctx->stream && opath) || map) {
+		out_open(&out, opath, map);
+		out.sparse = ctx->sparse;
+	}
+
+	rd_args.max_lnum = ctx->max_lnum;
+	if (ctx->sha256)
+		rd_args.sha256 = sha256;
+	rd_args.verify = ctx->verify;
+	if (ctx->deferred) {
+		rd_args.deferred = ctx->deferred;
+		rd_args.deferred_max = ctx->max_lnum + 1;
+		rd_args.deferred_nb = &deferred_nb;
+	}
+	if (ctx->decomp) {
+		rd_args.leb_fn = pipe_leb;
+		rd_args.leb_arg = &pipe;
+	} else if (ctx->stream && opath) {
+		rd_args.leb_fn = stream_leb;
+		rd_args.leb_arg = &out;
+	}
+
+	len = -1;
+	for (int i = 0; i < nb_vols && len < 0; i++) {
+		name = vol_names[order[i]];
+		vol_id = vol_ids[order[i]];
+
+		if (!ctx->decomp && !ctx->stream) {
+			int sz = map ? lubi_vol_size(ctx->lubi_priv, vol_id) : 0;
+			int huge = ctx->out_io == OUT_MMAP_HUGE;
+			struct lubi_vol_info info;
+
+			// Room for up to a whole last LEB, should an older copy
+			// of it with more data be read instead, trimmed after
+			if (sz > 0 &&
+			    !lubi_get_vol_info(ctx->lubi_priv, vol_id, &info))
+				sz = (sz + info.leb_sz - 1) / info.leb_sz *
+				     info.leb_sz;
+			else
+				sz = 0;
+			rd_args.buf = map ? out_map(&out, sz, huge) : NULL;
+			if (!rd_args.buf && !ctx->buf &&
+			    posix_memalign((void **)&ctx->buf, IO_ALIGN,
+					   ctx->buf_sz))
+				handle_error("posix_memalign");
+			if (!rd_args.buf)
+				rd_args.buf = ctx->buf;
+		}
+
+		if (ctx->stream) {
+			// Start over after a failed candidate
+			if (out.off && !out.seekable)
+				break;
+			out.off = 0;
+			MSG(ctx, "Streaming volume \"%s\" ..\n", name);
+		}
+		if (ctx->decomp)
+			pipe_start(&pipe, ctx->decomp, opath ? &out : NULL,
+				   ctx->peb_sz);
+		len = read_vol(ctx, vol_id, &rd_args);
+		if (ctx->decomp && pipe_finish(&pipe) && len >= 0) {
+			MSG(ctx, "%s:%d: %s decompression failed\n",
+			    __func__, __LINE__, dec_name(ctx->decomp));
+			len = -1;
+		} else if (len < 0) {
+			MSG(ctx, "%s:%d: lubi_read_vol_ext failed\n",
+			    __func__, __LINE__);
+		} else if (ctx->deferred &&
+			 lubi_check_lebs(rd_args.buf, ctx->deferred,
+					 deferred_nb)) {
+			// Late CRC mismatch: re-read with older copies as fallback
+			MSG(ctx, "%s:%d: deferred check failed, re-reading\n",
+			    __func__, __LINE__);
+			rd_args.verify = LUBI_VERIFY_FULL;
+			len = read_vol(ctx, vol_id, &rd_args);
+			rd_args.verify = ctx->verify;
+		}
+	}
+	ctx->name = name;
+	if (len < 0) {
+		// Do not leave a truncated volume behind
+		if ((ctx->stream || map) && cache && out.seekable) {
+			unlink(opath);
+			cache_store(ctx->lubi_priv, opath, -1, NULL);
+		}
+		goto out;
+	}
+	ctx->len = len;
+
+	if (ctx->decomp)
+		MSG(ctx, "%s: %llu -> %llu bytes - read %.1f MB/s, "
+		    "decompress %.1f MB/s, write %.1f MB/s\n",
+		    dec_name(ctx->decomp), pipe.in_bytes, pipe.out_bytes,
+		    mb_s(pipe.in_bytes, pipe.read_s),
+		    mb_s(pipe.out_bytes, pipe.dec_s),
+		    mb_s(pipe.out_bytes, pipe.write_s));
+
+	if (!opath) {
+		// Checked only
+	} else if (ctx->stream) {
+		// Trailing holes
+		if (out.seekable && ftruncate(out.fd, out.off))
+			handle_error("ftruncate");
+		MSG(ctx, "Streamed volume \"%s\" (%d bytes)\n", name, len);
+	} else if (out.map) {
+		// Already in the page cache, the spare room dropped
+		out_unmap(&out);
+		if (ftruncate(out.fd, len))
+			handle_error("ftruncate");
+		MSG(ctx, "Mapped volume \"%s\" (%d bytes)\n", name, len);
+	} else {
+		if (!map)
+			out_open(&out, opath, 0);
+		MSG(ctx, "Dumping volume \"%s\" (%d bytes) ..\n", name, len);
+		if (out_write(&out, ctx->buf, len))
+			handle_error("write");
+	}
+	if (out.tty)
+		putchar('\n');
+
+	if (ctx->sha256 && !ctx->quiet)
+		print_sha256(sha256, name);
+
+	if (cache)
+		cache_store(ctx->lubi_priv, opath, ctx->decomp ? -1 : vol_id,
+			    ctx->sha256 ? sha256 : NULL);
+out:
+	out_unmap(&out);
+	if (out.fd > 0 && out.fd != fileno(stdout))
+		close(out.fd);
+	free(out.ff);
+	pipe_free(&pipe);
+
+	return len < 0 ? -1 : 0;
+}
+
+/*
+ * Batch mode: the jobs of a manifest, one dump each, run on a pool of
+ * workers each reusing its lubi_priv and volume buffer from job to job
+ *
+ * Manifest lines: dump peb_sz peb_min peb_nb volume[,volume..]|* [out_dir]
+ * peb_nb 0 spans the whole dump, * stands for all the volumes, and the
+ * volumes are only checked unless out_dir is given
+ */
+#define BATCH_VOLS_MAX		128
+
+#define BATCH_NAME_MAX		128
+
+struct batch_opts {
+	int io;
+	int qd;
+	int io_page;
+	int oob_page;
+	int oob_sz;
+	int bbm;
+	int sha256;
+	int verify;
+	int force;
+	const struct nand_timing *sim;
+};
+
+struct batch_vol {
+	char name[BATCH_NAME_MAX];
+	int len;
+	int cached;
+	uint8_t sha256[LUBI_SHA256_SZ];
+};
+
+struct batch_job {
+	int line;
+	char *dump;
+	int peb_sz;
+	int peb_min;
+	int peb_nb;
+	char *vols;
+	char *odir;
+
+	const char *error;
+	double attach_s;
+	double total_s;
+	double sim_attach_us;		// simulated NAND time, c.f. nand_sim
+	double sim_read_us;
+	long long bytes;
+	int nb_vols;
+	struct batch_vol *res;
+};
+
+struct batch {
+	const struct batch_opts *opts;
+	struct batch_job *jobs;
+	int nb_jobs;
+	int next;			// next job to pick
+	pthread_mutex_t lock;
+};
+
+struct batch_worker {
+	pthread_t thread;
+	struct batch *batch;
+	void *lubi_priv;
+	unsigned char *buf;
+	size_t buf_sz;
+	struct lubi_leb_crc *deferred;
+	int deferred_max;
+};
+
+/**
+ * Extracts one volume of the job, given by name or by slot for '*'
+ */
+static void batch_vol(struct batch_worker *w, struct batch_job *job,
+		      struct ctx *ctx, const char *name, int vol_id)
+{
+	const struct batch_opts *opts = w->batch->opts;
+	struct batch_vol *res = &job->res[job->nb_vols];
+	char path[PATH_MAX];
+	int upd_marker, n;
+
+	if (job->nb_vols == BATCH_VOLS_MAX)
+		return;
+	job->nb_vols++;
+	snprintf(res->name, sizeof(res->name), "%s", name);
+	res->len = -1;
+
+	if (vol_id < 0 &&
+	    (vol_id = lubi_get_vol_id(ctx->lubi_priv, name, &upd_marker)) < 0)
+		return;
+
+	if (job->odir) {
+		n = snprintf(path, sizeof(path), "%s/", job->odir);
+		for (const char *c = name; *c && n < PATH_MAX - 1; c++)
+			path[n++] = *c == '/' ? '_' : *c;
+		path[n] = '\0';
+	}
+
+	ctx->sha256 = opts->sha256;
+	if (extract(ctx, &name, &vol_id, 1, job->odir ? path : NULL))
+		return;
+
+	res->len = ctx->len;
+	res->cached = ctx->cached;
+	memcpy(res->sha256, ctx->digest, LUBI_SHA256_SZ);
+	job->bytes += ctx->len;
+}
+
+/**
+ *
+ */
+static void batch_job(struct batch_worker *w, struct batch_job *job)
+{
+	const struct batch_opts *opts = w->batch->opts;
+	struct ctx ctx = { 0 };
+	struct data data;
+	struct nand_sim sim;
+	int peb_nb, failed = 0;
+	double t0 = now();
+
+	if (!(job->res = calloc(BATCH_VOLS_MAX, sizeof(*job->res)))) {
+		job->error = "calloc";
+		return;
+	}
+	if (fio_open(&data.fio, job->dump, opts->io, opts->qd, job->peb_sz)) {
+		job->error = "open";
+		job->total_s = now() - t0;
+		return;
+	}
+	data.peb_sz = job->peb_sz;
+	data.io_page_sz = 0;
+	data.sim = NULL;
+	data.fio.page_sz = opts->io_page;
+	if (opts->oob_page &&
+	    fio_set_oob(&data.fio, opts->oob_page, opts->oob_sz)) {
+		job->error = "fio_set_oob";
+		goto out;
+	}
+	peb_nb = job->peb_nb ? job->peb_nb : data.fio.size / data.fio.peb_stride;
+
+	// Grown to the largest geometry seen so far
+	if (w->buf_sz < (size_t)data.peb_sz * peb_nb) {
+		free(w->buf);
+		w->buf_sz = (size_t)data.peb_sz * peb_nb;
+		if (posix_memalign((void **)&w->buf, IO_ALIGN, w->buf_sz)) {
+			w->buf = NULL;
+			w->buf_sz = 0;
+			job->error = "posix_memalign";
+			goto out;
+		}
+	}
+	if (opts->verify == LUBI_VERIFY_DEFERRED && w->deferred_max < peb_nb) {
+		free(w->deferred);
+		w->deferred_max = peb_nb;
+		if (!(w->deferred = calloc(peb_nb, sizeof(*w->deferred)))) {
+			w->deferred_max = 0;
+			job->error = "calloc";
+			goto out;
+		}
+	}
+
+	if (lubi_init(w->lubi_priv, &data, flash_read, data.peb_sz,
+		      job->peb_min, peb_nb)) {
+		job->error = "lubi_init";
+		goto out;
+	}
+	if (opts->io_page) {
+		if (lubi_set_io_align(w->lubi_priv, opts->io_page, IO_ALIGN)) {
+			job->error = "lubi_set_io_align";
+			goto out;
+		}
+		data.io_page_sz = opts->io_page;
+	}
+	if (opts->io != FIO_MMAP)
+		lubi_set_prefetch(w->lubi_priv, prefetch, opts->qd);
+	if (opts->bbm)
+		lubi_set_bad_peb(w->lubi_priv, is_bad);
+	if (opts->sim) {
+		nand_sim_init(&sim, opts->sim, data.peb_sz);
+		nand_sim_phase(&sim, "attach");
+		data.sim = &sim;
+	}
+	if (lubi_attach(w->lubi_priv, 0, 0)) {
+		job->error = "lubi_attach";
+		goto out;
+	}
+	job->attach_s = now() - t0;
+	if (data.sim)
+		nand_sim_phase(&sim, "read");
+
+	if (job->odir && mkdir(job->odir, 0755) && errno != EEXIST) {
+		job->error = "mkdir";
+		goto out;
+	}
+
+	ctx.lubi_priv = w->lubi_priv;
+	ctx.buf = w->buf;
+	ctx.deferred = opts->verify == LUBI_VERIFY_DEFERRED ? w->deferred : NULL;
+	ctx.max_lnum = peb_nb - 1;
+	ctx.verify = opts->verify;
+	ctx.force = opts->force;
+	ctx.quiet = 1;
+
+	if (!strcmp(job->vols, "*")) {
+		struct lubi_vol_info info;
+
+		for (int vol_id = 0;
+		     !lubi_get_vol_info(w->lubi_priv, vol_id, &info); vol_id++)
+			if (info.name)
+				batch_vol(w, job, &ctx, info.name, vol_id);
+	} else {
+		char *save, *vols = strdup(job->vols);
+
+		for (char *name = strtok_r(vols, ",", &save); name;
+		     name = strtok_r(NULL, ",", &save))
+			batch_vol(w, job, &ctx, name, -1);
+		free(vols);
+	}
+
+	for (int i = 0; i < job->nb_vols; i++)
+		failed |= job->res[i].len < 0;
+	if (failed)
+		job->error = "volume";
+out:
+	if (data.sim) {
+		job->sim_attach_us = nand_sim_us(&sim, "attach");
+		job->sim_read_us = nand_sim_us(&sim, "read");
+	}
+	fio_close(&data.fio);
+	job->total_s = now() - t0;
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch_worker *w = arg;
+	struct batch *batch = w->batch;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->nb_jobs)
+			break;
+		batch_job(w, &batch->jobs[i]);
+	}
+	return NULL;
+}
+
+/**
+ *
+ */
+static int batch_load(struct batch *batch, const char *manifest)
+{
+	FILE *f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	char *line = NULL;
+	size_t line_sz = 0;
+	int nb = 0, max = 0;
+
+	if (!f)
+		return -1;
+
+	while (getline(&line, &line_sz, f) > 0) {
+		struct batch_job *job;
+		char *save, *tok[6];
+		int n = 0;
+
+		nb++;
+		for (char *t = strtok_r(line, " \t\n", &save); t && n < 6;
+		     t = strtok_r(NULL, " \t\n", &save))
+			tok[n++] = t;
+		if (!n || tok[0][0] == '#')
+			continue;
+		if (n < 5)
+			errx(-1, "%s:%d: expected dump peb_sz peb_min peb_nb "
+			     "volumes [out_dir]", manifest, nb);
+
+		if (batch->nb_jobs == max) {
+			max = max ? 2 * max : 64;
+			batch->jobs = realloc(batch->jobs, max * sizeof(*job));
+			if (!batch->jobs)
+				return -1;
+		}
+		job = &batch->jobs[batch->nb_jobs++];
+		memset(job, 0, sizeof(*job));
+		job->line = nb;
+		job->dump = strdup(tok[0]);
+		job->peb_sz = atoi(tok[1]);
+		job->peb_min = atoi(tok[2]);
+		job->peb_nb = atoi(tok[3]);
+		job->vols = strdup(tok[4]);
+		job->odir = n > 5 ? strdup(tok[5]) : NULL;
+		if (job->peb_sz <= 0 || job->peb_min < 0 || job->peb_nb < 0)
+			errx(-1, "%s:%d: bad geometry", manifest, nb);
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+static void json_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * One JSON object: per-job results in manifest order, then totals
+ */
+static void batch_report(FILE *f, const struct batch *batch, int workers,
+			 double wall_s)
+{
+	long long bytes = 0;
+	int failed = 0;
+
+	fprintf(f, "{\n  \"jobs\": [");
+	for (int i = 0; i < batch->nb_jobs; i++) {
+		const struct batch_job *job = &batch->jobs[i];
+
+		fprintf(f, "%s\n    {\"dump\": ", i ? "," : "");
+		json_str(f, job->dump);
+		fprintf(f, ", \"line\": %d, \"ok\": %s, \"error\": ", job->line,
+			job->error ? "false" : "true");
+		if (job->error)
+			json_str(f, job->error);
+		else
+			fprintf(f, "null");
+		fprintf(f, ", \"attach_ms\": %.3f, \"ms\": %.3f, \"bytes\": %lld, "
+			"\"MBps\": %.1f, ", job->attach_s * 1e3,
+			job->total_s * 1e3, job->bytes,
+			job->total_s ? job->bytes / job->total_s / 1e6 : 0);
+		if (batch->opts->sim)
+			fprintf(f, "\"sim_attach_ms\": %.3f, \"sim_read_ms\": %.3f, ",
+				job->sim_attach_us / 1e3, job->sim_read_us / 1e3);
+		fprintf(f, "\"volumes\": [");
+		for (int j = 0; j < job->nb_vols; j++) {
+			const struct batch_vol *res = &job->res[j];
+
+			fprintf(f, "%s\n      {\"name\": ", j ? "," : "");
+			json_str(f, res->name);
+			fprintf(f, ", \"ok\": %s, \"bytes\": %d, \"cached\": %s",
+				res->len < 0 ? "false" : "true",
+				res->len < 0 ? 0 : res->len,
+				res->cached ? "true" : "false");
+			if (batch->opts->sha256 && res->len >= 0) {
+				fprintf(f, ", \"sha256\": \"");
+				for (int k = 0; k < LUBI_SHA256_SZ; k++)
+					fprintf(f, "%02x", res->sha256[k]);
+				fprintf(f, "\"");
+			}
+			fprintf(f, "}");
+		}
+		fprintf(f, "%s]}", job->nb_vols ? "\n    " : "");
+
+		bytes += job->bytes;
+		failed += !!job->error;
+	}
+	fprintf(f, "\n  ],\n  \"workers\": %d, \"images\": %d, \"failed\": %d, "
+		"\"bytes\": %lld, \"seconds\": %.3f, \"MBps\": %.1f, "
+		"\"images_per_s\": %.1f\n}\n", workers, batch->nb_jobs, failed,
+		bytes, wall_s, wall_s ? bytes / wall_s / 1e6 : 0,
+		wall_s ? batch->nb_jobs / wall_s : 0);
+}
+
+/**
+ *
+ */
+static int batch_run(const char *manifest, const struct batch_opts *opts,
+		     int workers, const char *opath)
+{
+	struct batch batch = { .opts = opts };
+	struct batch_worker *w;
+	FILE *f = stdout;
+	double t0;
+	int failed = 0;
+
+	if (batch_load(&batch, manifest))
+		handle_error(manifest);
+	if (workers > batch.nb_jobs)
+		workers = batch.nb_jobs ? batch.nb_jobs : 1;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	if (!(w = calloc(workers, sizeof(*w))))
+		handle_error("calloc");
+
+	t0 = now();
+	for (int i = 0; i < workers; i++) {
+		w[i].batch = &batch;
+		if (posix_memalign(&w[i].lubi_priv, IO_ALIGN, lubi_mem_sz()))
+			handle_error("posix_memalign");
+		if (pthread_create(&w[i].thread, NULL, batch_worker, &w[i]))
+			errx(-1, "pthread_create");
+	}
+	for (int i = 0; i < workers; i++) {
+		pthread_join(w[i].thread, NULL);
+		free(w[i].lubi_priv);
+		free(w[i].buf);
+		free(w[i].deferred);
+	}
+
+	if (strcmp(opath, "-") && !(f = fopen(opath, "w")))
+		handle_error(opath);
+	batch_report(f, &batch, workers, now() - t0);
+	if (f != stdout)
+		fclose(f);
+
+	for (int i = 0; i < batch.nb_jobs; i++)
+		failed += !!batch.jobs[i].error;
+	return failed ? -1 : 0;
+}
+
+/*
+ * Stress benchmark: threads attaching and reading the same volume over and
+ * over, each with its own lubi_priv, the digests must all match that of a
+ * first single-threaded read
+ */
+struct stress {
+	const char *ipath;
+	const char *vol;
+	int peb_sz;
+	int peb_min;
+	int peb_nb;
+	int io;
+	int qd;
+	int iters;
+	int len;
+	uint8_t sha256[LUBI_SHA256_SZ];
+};
+
+struct stress_thread {
+	pthread_t thread;
+	const struct stress *st;
+	int failures;
+};
+
+/**
+ * Attaches and reads the volume, returns its length
+ */
+static int stress_once(const struct stress *st, void *lubi_priv,
+		       unsigned char *buf, uint8_t *sha256)
+{
+	struct lubi_rd_args rd_args = { 0 };
+	struct data data;
+	int vol_id, upd_marker, len = -1;
+
+	if (fio_open(&data.fio, st->ipath, st->io, st->qd, st->peb_sz))
+		return -1;
+	data.peb_sz = st->peb_sz;
+	data.io_page_sz = 0;
+	data.sim = NULL;
+
+	rd_args.buf = buf;
+	rd_args.max_lnum = st->peb_nb - 1;
+	rd_args.sha256 = sha256;
+	if (!lubi_init(lubi_priv, &data, flash_read, st->peb_sz, st->peb_min,
+		       st->peb_nb) &&
+	    (st->io == FIO_MMAP ||
+	     !lubi_set_prefetch(lubi_priv, prefetch, st->qd)) &&
+	    !lubi_attach(lubi_priv, 0, 0) &&
+	    (vol_id = lubi_get_vol_id(lubi_priv, st->vol, &upd_marker)) >= 0)
+		len = lubi_read_vol_ext(lubi_priv, vol_id, &rd_args);
+
+	fio_close(&data.fio);
+	return len;
+}
+
+static void *stress_thread(void *arg)
+{
+	struct stress_thread *t = arg;
+	const struct stress *st = t->st;
+	uint8_t sha256[LUBI_SHA256_SZ];
+	unsigned char *buf;
+	void *lubi_priv;
+
+	if (posix_memalign(&lubi_priv, IO_ALIGN, lubi_mem_sz()) ||
+	    posix_memalign((void **)&buf, IO_ALIGN,
+			   (size_t)st->peb_sz * st->peb_nb))
+		errx(-1, "posix_memalign");
+
+	for (int i = 0; i < st->iters; i++)
+		if (stress_once(st, lubi_priv, buf, sha256) != st->len ||
+		    memcmp(sha256, st->sha256, LUBI_SHA256_SZ))
+			t->failures++;
+
+	free(buf);
+	free(lubi_priv);
+	return NULL;
+}
+
+/**
+ *
+ */
+static int stress_run(struct stress *st, int threads)
+{
+	struct stress_thread *t;
+	unsigned char *buf;
+	void *lubi_priv;
+	int failures = 0;
+	double t0, s;
+
+	if (posix_memalign(&lubi_priv, IO_ALIGN, lubi_mem_sz()) ||
+	    posix_memalign((void **)&buf, IO_ALIGN,
+			   (size_t)st->peb_sz * st->peb_nb))
+		handle_error("posix_memalign");
+	st->len = stress_once(st, lubi_priv, buf, st->sha256);
+	free(buf);
+	free(lubi_priv);
+	if (st->len < 0)
+		errx(-1, "Could not read volume \"%s\"", st->vol);
+
+	if (!(t = calloc(threads, sizeof(*t))))
+		handle_error("calloc");
+
+	t0 = now();
+	for (int i = 0; i < threads; i++) {
+		t[i].st = st;
+		if (pthread_create(&t[i].thread, NULL, stress_thread, &t[i]))
+			errx(-1, "pthread_create");
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		failures += t[i].failures;
+	}
+	s = now() - t0;
+	free(t);
+
+	fprintf(stderr, "stress: %d threads x %d attach+read of \"%s\" "
+		"(%d bytes): %d failures, %.3f s, %.1f reads/s, %.1f MB/s\n",
+		threads, st->iters, st->vol, st->len, failures, s,
+		threads * st->iters / s,
+		(double)threads * st->iters * st->len / s / 1e6);
+
+	return failures ? -1 : 0;
+}
+
+static void print_stats(const struct lubi_stats *stats,
+			const struct fio *fio)
+{
+	static const char *const verify[] = { "full", "hdr", "deferred" };
+
+	fprintf(stderr, "flash reads:   %u (%llu bytes)\n"
+		"LEBs checked:  %u\n"
+		"LEBs known:    %u\n"
+		"LEBs trusted:  %u\n"
+		"LEBs deferred: %u\n"
+		"bad PEBs:      %u\n"
+		"PEBs kept:     %u\n"
+		"PEBs unscanned: %u (%u fallbacks)\n"
+		"verification:  %s (used:",
+		stats->flash_reads, stats->flash_bytes, stats->lebs_checked,
+		stats->lebs_known, stats->lebs_trusted, stats->lebs_deferred,
+		stats->bad_pebs, stats->pebs_kept, stats->pebs_unscanned,
+		stats->fast_fallbacks, verify[stats->last_verify]);
+	for (int i = 0; i < 3; i++)
+		if (stats->verify_mask & (1 << i))
+			fprintf(stderr, " %s", verify[i]);
+	fprintf(stderr, ")\n");
+
+	if (fio->type == FIO_URING)
+		fprintf(stderr, "io_uring:      %u hits, %u misses, %u dropped, "
+			"%u submits (qd %d)\n", fio->stats.hits,
+			fio->stats.misses, fio->stats.dropped,
+			fio->stats.submits, fio->qd);
+}
+
+static uint64_t clock_ns(__attribute__((unused)) void *priv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Writes the trace ring as Chrome trace-event JSON, for chrome://tracing or
+ * Perfetto: one complete event per flash read, CRC and phase, in us since
+ * the first one
+ */
+static void trace_dump(const void *lubi_priv, const char *path)
+{
+	static const char *const crcs[] = {
+		"EC hdr CRC", "VID hdr CRC", "vtbl CRC", "data CRC",
+	};
+	static const char *const phases[] = {
+		"attach", "scan ECs", "scan VIDs", "read vol",
+	};
+	struct lubi_trace_ev *evs;
+	unsigned int lost;
+	uint64_t t0;
+	int nb = lubi_get_trace(lubi_priv, NULL, 0, &lost);
+	FILE *f;
+
+	if (nb < 0) {
+		fprintf(stderr, "%s: built without the trace ring\n", __func__);
+		return;
+	}
+	if (!(evs = calloc(nb ? nb : 1, sizeof(*evs))))
+		handle_error("calloc");
+	nb = lubi_get_trace(lubi_priv, evs, nb, NULL);
+	if (!(f = strcmp(path, "-") ? fopen(path, "w") : stderr))
+		handle_error(path);
+
+	// Phases end after what they hold, so start from the earliest one
+	t0 = nb ? evs[0].ts : 0;
+	for (int i = 1; i < nb; i++)
+		if (evs[i].ts < t0)
+			t0 = evs[i].ts;
+
+	fprintf(f, "{\"traceEvents\": [");
+	for (int i = 0; i < nb; i++) {
+		const struct lubi_trace_ev *ev = &evs[i];
+		const char *name = "flash_read", *cat = "read";
+
+		if (ev->type == LUBI_EV_CRC) {
+			name = crcs[ev->id];
+			cat = "crc";
+		} else if (ev->type == LUBI_EV_PHASE) {
+			name = phases[ev->id];
+			cat = "phase";
+		}
+		fprintf(f, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", "
+			"\"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+			"\"ts\": %.3f, \"dur\": %.3f, \"args\": {", i ? "," : "",
+			name, cat, (ev->ts - t0) / 1e3, ev->dur / 1e3);
+		if (ev->type == LUBI_EV_PHASE && ev->id == LUBI_PH_READ_VOL)
+			fprintf(f, "\"vol_id\": %d, \"len\": %u, ", ev->pnum,
+				ev->len);
+		else if (ev->type != LUBI_EV_PHASE)
+			fprintf(f, "\"pnum\": %d, \"offset\": %u, "
+				"\"len\": %u, ", ev->pnum, ev->offset, ev->len);
+		fprintf(f, "\"ret\": %d}}", ev->ret);
+	}
+	fprintf(f, "\n],\n\"otherData\": {\"events\": %d, \"lost\": %u}}\n",
+		nb, lost);
+
+	if (f != stderr)
+		fclose(f);
+	free(evs);
 }
 
 static void usage(char *prg)
@@ -47,10 +1399,41 @@ static void usage(char *prg)
 		"\t\t--ifile in_file\n"
 		"\t\t[--ofile out_file]\n"
 		"\t\t[--peb_min peb_min]\n"
-		"\t\t[--peb_nb peb_nb]\n"
+		"\t\t[--peb_nb peb_nb | --parts peb_min:peb_nb[,..]]\n"
 		"\t\t--peb_sz peb_sz\n"
-		"\t\t[--vol volume_name]\n",
-		prg);
+		"\t\t[--io_page page_sz]\n"
+		"\t\t[--vol volume_name[,volume_name..] | --odir out_dir]\n"
+		"\t\t[--stream]\n"
+		"\t\t[--sparse]\n"
+		"\t\t[--sha256]\n"
+		"\t\t[--verify full|hdr|deferred]\n"
+		"\t\t[--stats]\n"
+		"\t\t[--io mmap|pread|uring]\n"
+		"\t\t[--qd queue_depth]\n"
+		"\t\t[--out_io write|mmap|mmap_huge]\n"
+		"\t\t[--force]\n"
+		"\t\t[--page_sz page_sz --oob_sz oob_sz [--bbm]]\n"
+		"\t\t[--targeted [--fast_attach window]]\n"
+		"\t\t[--decompress lz4|lzma]\n"
+		"\t\t[--nand_sim default|key=val[,..]]\n"
+		"\t\t[--trace trace.json]\n"
+		"\t\t[--steps budget]\n"
+		"   or: %s\n"
+		"\t\t--batch manifest\n"
+		"\t\t[--jobs nb]\n"
+		"\t\t[--ofile report]\n"
+		"   or: %s\n"
+		"\t\t--ifile in_file --peb_sz peb_sz --vol volume_name\n"
+		"\t\t--stress nb_threads\n"
+		"\t\t[--iters nb]\n"
+		"   or: %s\n"
+		"\t\t--serve socket\n"
+		"\t\t[--cache_mb nb]\n"
+		"   or: %s\n"
+		"\t\t--client socket --ifile in_file --peb_sz peb_sz\n"
+		"\t\t[--peb_min peb_min] [--peb_nb peb_nb]\n"
+		"\t\t[--vol volume_name [--range offset:len]] [--ofile out_file]\n",
+		prg, prg, prg, prg, prg);
 }
 
 static void version(char *prg)
@@ -61,15 +1444,31 @@ static void version(char *prg)
 int main(int argc, char *argv[])
 {
 	struct data data;
-	void *lubi_priv;
-	int i_fd, o_fd, len;
-	struct stat stat;
+	void *lubi_priv, *part;
 
-	unsigned char *buf;
-	int vol_id, upd_marker;
+	struct ctx ctx = { 0 };
+	int vol_id, upd_marker, ret = 0;
+	int arg_stream = 0, arg_sparse = 0, arg_sha256 = 0, arg_stats = 0;
+	int arg_verify = LUBI_VERIFY_FULL, arg_force = 0;
+	const char *vol_names[VOL_CANDIDATES_MAX];
+	int vol_ids[VOL_CANDIDATES_MAX], nb_vols = 0;
 
-	const char *arg_ipath = NULL, *arg_opath = "-", *arg_volname = NULL;
-	int arg_peb_sz = 0, arg_peb_min = 0, arg_peb_nb = 0;
+	const char *arg_ipath = NULL, *arg_opath = "-", *arg_odir = NULL;
+	const char *arg_batch = NULL;
+	int arg_jobs = 0, arg_stress = 0, arg_iters = 100;
+	int arg_oob_page = 0, arg_oob_sz = 0, arg_bbm = 0, arg_targeted = 0;
+	int arg_decomp = DEC_NONE, arg_steps = 0, arg_fast = -1;
+	int arg_out_io = OUT_WRITE;
+	struct lubi_part parts[PARTS_MAX];
+	int nb_parts = 0;
+	const char *arg_serve = NULL, *arg_client = NULL;
+	long long arg_range_off = 0, arg_range_len = -1, arg_cache_mb = 64;
+	struct nand_timing sim_timing;
+	struct nand_sim sim;
+	const char *arg_sim = NULL, *arg_trace = NULL;
+	char *arg_volname = NULL;
+	int arg_peb_sz = 0, arg_peb_min = 0, arg_peb_nb = 0, arg_io_page = 0;
+	int arg_io = FIO_MMAP, arg_qd = QD_DEFAULT;
 	char *prg = basename(argv[0]);
 
 	for (;;) {
@@ -82,6 +1481,35 @@ int main(int argc, char *argv[])
 			{"peb_sz",     required_argument, 0, 5},
 			{"vol",        required_argument, 0, 6},
 			{"version",    no_argument,       0, 7},
+			{"stream",     no_argument,       0, 8},
+			{"sparse",     no_argument,       0, 9},
+			{"io_page",    required_argument, 0, 10},
+			{"sha256",     no_argument,       0, 11},
+			{"verify",     required_argument, 0, 12},
+			{"stats",      no_argument,       0, 13},
+			{"io",         required_argument, 0, 14},
+			{"qd",         required_argument, 0, 15},
+			{"force",      no_argument,       0, 16},
+			{"odir",       required_argument, 0, 17},
+			{"batch",      required_argument, 0, 18},
+			{"jobs",       required_argument, 0, 19},
+			{"stress",     required_argument, 0, 20},
+			{"iters",      required_argument, 0, 21},
+			{"page_sz",    required_argument, 0, 22},
+			{"oob_sz",     required_argument, 0, 23},
+			{"bbm",        no_argument,       0, 24},
+			{"targeted",   no_argument,       0, 25},
+			{"decompress", required_argument, 0, 26},
+			{"nand_sim",   required_argument, 0, 27},
+			{"trace",      required_argument, 0, 28},
+			{"steps",      required_argument, 0, 29},
+			{"serve",      required_argument, 0, 30},
+			{"client",     required_argument, 0, 31},
+			{"range",      required_argument, 0, 32},
+			{"cache_mb",   required_argument, 0, 33},
+			{"fast_attach", required_argument, 0, 34},
+			{"parts",      required_argument, 0, 35},
+			{"out_io",     required_argument, 0, 36},
 			{0, 0, 0, 0},
 		};
 		int opt_idx = 0;
@@ -114,85 +1542,414 @@ int main(int argc, char *argv[])
 		case  7:
 			version(prg);
 			exit(0);
+		case  8:
+			arg_stream = 1;
+			break;
+		case  9:
+			// Holes can only be punched as we go
+			arg_stream = arg_sparse = 1;
+			break;
+		case 10:
+			arg_io_page = atoi(optarg);
+			break;
+		case 11:
+			arg_sha256 = 1;
+			break;
+		case 12:
+			if (!strcmp(optarg, "full"))
+				arg_verify = LUBI_VERIFY_FULL;
+			else if (!strcmp(optarg, "hdr"))
+				arg_verify = LUBI_VERIFY_HDR;
+			else if (!strcmp(optarg, "deferred"))
+				arg_verify = LUBI_VERIFY_DEFERRED;
+			else
+				errx(-1, "Bad verification policy: %s", optarg);
+			break;
+		case 13:
+			arg_stats = 1;
+			break;
+		case 14:
+			if (!strcmp(optarg, "mmap"))
+				arg_io = FIO_MMAP;
+			else if (!strcmp(optarg, "pread"))
+				arg_io = FIO_PREAD;
+			else if (!strcmp(optarg, "uring"))
+				arg_io = FIO_URING;
+			else
+				errx(-1, "Bad input backend: %s", optarg);
+			break;
+		case 15:
+			if ((arg_qd = atoi(optarg)) < 1)
+				errx(-1, "Bad queue depth: %s", optarg);
+			break;
+		case 16:
+			arg_force = 1;
+			break;
+		case 17:
+			arg_odir = optarg;
+			break;
+		case 18:
+			arg_batch = optarg;
+			break;
+		case 19:
+			if ((arg_jobs = atoi(optarg)) < 1)
+				errx(-1, "Bad number of jobs: %s", optarg);
+			break;
+		case 20:
+			if ((arg_stress = atoi(optarg)) < 1)
+				errx(-1, "Bad number of threads: %s", optarg);
+			break;
+		case 21:
+			if ((arg_iters = atoi(optarg)) < 1)
+				errx(-1, "Bad number of iterations: %s", optarg);
+			break;
+		case 22:
+			arg_oob_page = atoi(optarg);
+			break;
+		case 23:
+			arg_oob_sz = atoi(optarg);
+			break;
+		case 24:
+			arg_bbm = 1;
+			break;
+		case 25:
+			arg_targeted = 1;
+			break;
+		case 26:
+			// Decoded as the LEBs are read
+			if ((arg_decomp = dec_type(optarg)) < 0)
+				errx(-1, "Bad compression: %s", optarg);
+			arg_stream = 1;
+			break;
+		case 27:
+			if (nand_sim_parse(&sim_timing, optarg))
+				errx(-1, "Bad NAND timings: %s", optarg);
+			arg_sim = optarg;
+			break;
+		case 28:
+			arg_trace = optarg;
+			break;
+		case 29:
+			if ((arg_steps = atoi(optarg)) < 1)
+				errx(-1, "Bad step budget: %s", optarg);
+			break;
+		case 30:
+			arg_serve = optarg;
+			break;
+		case 31:
+			arg_client = optarg;
+			break;
+		case 32:
+			if (sscanf(optarg, "%lld:%lld", &arg_range_off,
+				   &arg_range_len) != 2 || arg_range_off < 0)
+				errx(-1, "Bad range: %s", optarg);
+			break;
+		case 33:
+			if ((arg_cache_mb = atoll(optarg)) < 0)
+				errx(-1, "Bad cache size: %s", optarg);
+			break;
+		case 34:
+			if ((arg_fast = atoi(optarg)) < 0)
+				errx(-1, "Bad fast attach window: %s", optarg);
+			break;
+		case 35:
+			// peb_min:peb_nb[,peb_min:peb_nb..]
+			for (char *tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ",")) {
+				if (nb_parts == PARTS_MAX)
+					errx(-1, "Too many partitions");
+				if (sscanf(tok, "%d:%d", &parts[nb_parts].peb_min,
+					   &parts[nb_parts].peb_nb) != 2 ||
+				    parts[nb_parts].peb_min < 0 ||
+				    parts[nb_parts].peb_nb < 1)
+					errx(-1, "Bad partition: %s", tok);
+				nb_parts++;
+			}
+			break;
+		case 36:
+			if (!strcmp(optarg, "write"))
+				arg_out_io = OUT_WRITE;
+			else if (!strcmp(optarg, "mmap"))
+				arg_out_io = OUT_MMAP;
+			else if (!strcmp(optarg, "mmap_huge"))
+				arg_out_io = OUT_MMAP_HUGE;
+			else
+				errx(-1, "Bad output backend: %s", optarg);
+			break;
 		}
 	}
 
+	// Simulated NAND pages: those of the dump, or of the I/O contract
+	if (arg_sim && !sim_timing.page_sz)
+		sim_timing.page_sz = arg_oob_page ? arg_oob_page :
+				     arg_io_page ? arg_io_page : 2048;
+
+	if (arg_batch) {
+		struct batch_opts opts = {
+			.io = arg_io, .qd = arg_qd, .io_page = arg_io_page,
+			.oob_page = arg_oob_page, .oob_sz = arg_oob_sz,
+			.bbm = arg_bbm,
+			.sha256 = arg_sha256, .verify = arg_verify,
+			.force = arg_force, .sim = arg_sim ? &sim_timing : NULL,
+		};
+
+		if (!arg_jobs)
+			arg_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		return batch_run(arg_batch, &opts, arg_jobs > 0 ? arg_jobs : 1,
+				 arg_opath);
+	}
+
+	if (arg_serve) {
+		struct dmn_opts opts = {
+			.io = arg_io, .qd = arg_qd,
+			.cache_sz = arg_cache_mb << 20,
+		};
+
+		return dmn_serve(arg_serve, &opts);
+	}
+
 	if (!arg_ipath || !arg_peb_sz) {
 		usage(prg);
 		exit(-1);
 	}
+	// The LEBs are gone by the time deferred CRCs could be checked
+	if (arg_stream && arg_verify == LUBI_VERIFY_DEFERRED)
+		errx(-1, "--verify deferred needs the whole volume in memory");
+	if (arg_odir && arg_volname)
+		errx(-1, "--odir extracts all the volumes, drop --vol");
+	if (!arg_oob_page != !arg_oob_sz || (arg_bbm && !arg_oob_sz))
+		errx(-1, "--page_sz and --oob_sz go together, and --bbm needs them");
+	if (arg_targeted && !arg_volname)
+		errx(-1, "--targeted needs --vol");
+	if (arg_fast >= 0 && !arg_targeted)
+		errx(-1, "--fast_attach needs --targeted");
+	if (nb_parts && (arg_targeted || arg_steps || arg_odir))
+		errx(-1, "--parts goes without --targeted, --steps and --odir");
+	if (arg_out_io != OUT_WRITE && arg_stream)
+		errx(-1, "--out_io mmap goes without --stream, --sparse and "
+		     "--decompress");
 
-	if ((i_fd = open(arg_ipath, O_RDONLY)) == -1)
-		handle_error(arg_ipath);
+	if (arg_client) {
+		struct dmn_req req = {
+			.path = arg_ipath, .peb_sz = arg_peb_sz,
+			.peb_min = arg_peb_min, .peb_nb = arg_peb_nb,
+			.vol = arg_volname, .offset = arg_range_off,
+			.len = arg_range_len,
+		};
 
-	if (fstat(i_fd, &stat) == -1)
-		handle_error(arg_ipath);
+		// Lists the volumes without --vol
+		return dmn_client(arg_client, &req, arg_opath) ? -1 : 0;
+	}
 
-	data.addr = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, i_fd, 0);
-	if (data.addr == MAP_FAILED)
-		handle_error("mmap");
+	if (arg_stress) {
+		struct stress st = {
+			.ipath = arg_ipath, .vol = arg_volname,
+			.peb_sz = arg_peb_sz, .peb_min = arg_peb_min,
+			.peb_nb = arg_peb_nb, .io = arg_io, .qd = arg_qd,
+			.iters = arg_iters,
+		};
+		struct stat sb;
 
-	if (!(lubi_priv = malloc(lubi_mem_sz())))
-		handle_error("malloc");
+		if (!arg_volname)
+			errx(-1, "--stress needs --vol");
+		if (!st.peb_nb) {
+			if (stat(arg_ipath, &sb))
+				handle_error(arg_ipath);
+			st.peb_nb = sb.st_size / arg_peb_sz;
+		}
+		return stress_run(&st, arg_stress);
+	}
+
+	if (fio_open(&data.fio, arg_ipath, arg_io, arg_qd, arg_peb_sz))
+		handle_error(arg_ipath);
+
+	if (posix_memalign(&lubi_priv, IO_ALIGN, nb_parts ?
+			   lubi_parts_mem_sz(nb_parts) : lubi_mem_sz()))
+		handle_error("posix_memalign");
 
 	data.peb_sz = arg_peb_sz;
+	data.io_page_sz = 0;
+	data.sim = NULL;
+	if (arg_sim) {
+		if (arg_peb_sz % sim_timing.page_sz)
+			errx(-1, "Bad NAND page size: %d", sim_timing.page_sz);
+		nand_sim_init(&sim, &sim_timing, arg_peb_sz);
+		data.sim = &sim;
+	}
+	if (arg_oob_page && fio_set_oob(&data.fio, arg_oob_page, arg_oob_sz))
+		errx(-1, "Bad page/OOB geometry: %d/%d", arg_oob_page, arg_oob_sz);
 	if (!arg_peb_nb)
-		arg_peb_nb = stat.st_size / data.peb_sz;
+		arg_peb_nb = data.fio.size / data.fio.peb_stride;
 
-	if (lubi_init(lubi_priv, &data, flash_read, data.peb_sz, arg_peb_min,
-		      arg_peb_nb)) {
+	if (nb_parts ? lubi_init_parts(lubi_priv, &data, flash_read,
+				       data.peb_sz, parts, nb_parts) :
+		       lubi_init(lubi_priv, &data, flash_read, data.peb_sz,
+				 arg_peb_min, arg_peb_nb)) {
 		fprintf(stderr, "%s:%d: lubi_init failed\n", __func__, __LINE__);
 		exit(-1);
 	}
-	if (lubi_attach(lubi_priv, 0, 0)) {
+	// Each partition has its own settings
+	for (int p = 0; (part = lubi_part(lubi_priv, p)); p++) {
+		if (arg_io_page) {
+			if (lubi_set_io_align(part, arg_io_page, IO_ALIGN)) {
+				fprintf(stderr, "%s:%d: lubi_set_io_align failed\n",
+					__func__, __LINE__);
+				exit(-1);
+			}
+			data.io_page_sz = arg_io_page;
+			data.fio.page_sz = arg_io_page;
+		}
+		// Keep up to qd reads in flight
+		if (arg_io != FIO_MMAP &&
+		    lubi_set_prefetch(part, prefetch, arg_qd)) {
+			fprintf(stderr, "%s:%d: lubi_set_prefetch failed\n",
+				__func__, __LINE__);
+			exit(-1);
+		}
+		if (arg_bbm)
+			lubi_set_bad_peb(part, is_bad);
+		if (arg_trace && lubi_set_trace(part, clock_ns))
+			errx(-1, "--trace: built without the trace ring");
+		lubi_set_fast_attach(part, arg_fast);
+	}
+	if (data.sim)
+		nand_sim_phase(data.sim, "attach");
+	if (arg_targeted || arg_steps) {
+		// Only keep the attach records of the --vol volumes
+		struct lubi_target targets[CFG_LUBI_TARGETS_MAX];
+		char *names = NULL;
+		int nb = 0, steps = 1;
+
+		if (arg_targeted && !(names = strdup(arg_volname)))
+			handle_error("strdup");
+		for (char *name = names ? strtok(names, ",") : NULL; name;
+		     name = strtok(NULL, ",")) {
+			if (nb == CFG_LUBI_TARGETS_MAX)
+				errx(-1, "--targeted takes up to %d volumes",
+				     CFG_LUBI_TARGETS_MAX);
+			targets[nb].name = name;
+			targets[nb++].vol_id = -1;
+		}
+		if (!arg_steps) {
+			ret = lubi_attach_vols(lubi_priv, 0, 0, targets, nb);
+		} else if (!(ret = lubi_attach_start(lubi_priv, 0, 0, targets,
+						     nb))) {
+			// As a bootloader would, between other init steps
+			while ((ret = lubi_attach_step(lubi_priv, arg_steps)) > 0)
+				steps++;
+			fprintf(stderr, "attach: %d steps of up to %d PEBs\n",
+				steps, arg_steps);
+		}
+		if (ret) {
+			fprintf(stderr, "%s:%d: lubi_attach_vols failed\n",
+				__func__, __LINE__);
+			exit(-1);
+		}
+		free(names);
+	} else if (nb_parts) {
+		// All the partitions in one pass, some may fail
+		if (lubi_attach_parts(lubi_priv, 0, 0))
+			fprintf(stderr, "%s:%d: lubi_attach_parts failed\n",
+				__func__, __LINE__);
+		for (int p = 0; p < nb_parts; p++) {
+			fprintf(stderr, "partition %d: PEBs %d..%d\n", p,
+				parts[p].peb_min,
+				parts[p].peb_min + parts[p].peb_nb - 1);
+			lubi_list_vols(lubi_part(lubi_priv, p));
+		}
+	} else if (lubi_attach(lubi_priv, 0, 0)) {
 		fprintf(stderr, "%s:%d: lubi_attach failed\n", __func__, __LINE__);
 		exit(-1);
 	}
-	if (lubi_list_vols(lubi_priv)) {
+	if (!nb_parts && lubi_list_vols(lubi_priv)) {
 		fprintf(stderr, "%s:%d: lubi_list_vols failed\n", __func__, __LINE__);
 		exit(-1);
 	}
 
-	if (!arg_volname)
+	if (!arg_volname && !arg_odir) {
+		if (data.sim)
+			nand_sim_print(stderr, data.sim);
+		if (arg_trace)
+			trace_dump(lubi_priv, arg_trace);
 		return 0;
-
-	if ((vol_id = lubi_get_vol_id(lubi_priv, arg_volname, &upd_marker)) < 0) {
-		fprintf(stderr, "%s:%d: Could not find volume \"%s\"\n",
-		       __func__, __LINE__, arg_volname);
-		exit(-1);
-	}
-	if (!(buf = malloc(data.peb_sz * arg_peb_nb)))
-		handle_error("malloc");
-	if ((len = lubi_read_svol(lubi_priv, buf, vol_id, arg_peb_nb - 1, 0)) < 0) {
-		fprintf(stderr, "%s:%d: lubi_read_svol failed\n", __func__, __LINE__);
-		exit(-1);
 	}
 
-	if (!strcmp(arg_opath, "-")) {
-		o_fd = fileno(stdout);
-	} else {
-		o_fd = open(arg_opath, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-		if (o_fd == -1)
-			handle_error(arg_opath);
+	if (data.sim)
+		nand_sim_phase(data.sim, "read");
+
+	// --vol part:name[,name..]
+	if (nb_parts) {
+		char *end;
+		long p = strtol(arg_volname, &end, 10);
+
+		if (end == arg_volname || *end != ':' || p < 0 || p >= nb_parts)
+			errx(-1, "--parts needs --vol part:name");
+		arg_volname = end + 1;
+		lubi_priv = lubi_part(lubi_priv, p);
+		arg_peb_nb = parts[p].peb_nb;
 	}
 
-	fprintf(stderr, "Dumping volume \"%s\" (%d bytes) ..\n", arg_volname, len);
-	if (!isatty(o_fd)) {
-		while (len) {
-			ssize_t w = write(o_fd, buf, len);
-			if (w < 0)
-				handle_error("write");
-			buf += w;
-			len -= w;
+	ctx.lubi_priv = lubi_priv;
+	ctx.max_lnum = arg_peb_nb - 1;
+	ctx.stream = arg_stream;
+	ctx.sparse = arg_sparse;
+	ctx.sha256 = arg_sha256;
+	ctx.verify = arg_verify;
+	ctx.force = arg_force;
+	ctx.decomp = arg_decomp;
+	ctx.peb_sz = data.peb_sz;
+	ctx.steps = arg_steps;
+	ctx.out_io = arg_out_io;
+	ctx.buf_sz = (size_t)data.peb_sz * arg_peb_nb;
+	if (arg_verify == LUBI_VERIFY_DEFERRED &&
+	    !(ctx.deferred = calloc(arg_peb_nb, sizeof(*ctx.deferred))))
+		handle_error("calloc");
+
+	if (arg_odir) {
+		struct lubi_vol_info info;
+
+		// All volumes, each to odir/name
+		for (vol_id = 0; !lubi_get_vol_info(lubi_priv, vol_id, &info);
+		     vol_id++) {
+			char path[PATH_MAX];
+			int n;
+
+			if (!info.name)
+				continue;
+			n = snprintf(path, sizeof(path), "%s/", arg_odir);
+			for (const char *c = info.name; *c && n < PATH_MAX - 1; c++)
+				path[n++] = *c == '/' ? '_' : *c;
+			path[n] = '\0';
+
+			if (extract(&ctx, &info.name, &vol_id, 1, path))
+				ret = -1;
 		}
 	} else {
-		for (int i = 0; i < len; i++) {
-			if (!(i % 4) && i)
-				putchar(i % 16 ? ' ' : '\n');
-			printf("%02x ", buf[i]);
+		// A/B candidates, e.g. --vol kernel_a,kernel_b
+		for (char *name = strtok(arg_volname, ","); name;
+		     name = strtok(NULL, ",")) {
+			if (nb_vols == VOL_CANDIDATES_MAX)
+				errx(-1, "Too many volumes");
+			if ((vol_id = lubi_get_vol_id(lubi_priv, name, &upd_marker)) < 0) {
+				fprintf(stderr, "%s:%d: Could not find volume \"%s\"\n",
+					__func__, __LINE__, name);
+				continue;
+			}
+			vol_names[nb_vols] = name;
+			vol_ids[nb_vols++] = vol_id;
 		}
-		putchar('\n');
+		if (!nb_vols)
+			exit(-1);
+
+		ret = extract(&ctx, vol_names, vol_ids, nb_vols, arg_opath);
 	}
 
-	return 0;
+	if (arg_stats)
+		print_stats(lubi_get_stats(lubi_priv), &data.fio);
+	if (data.sim)
+		nand_sim_print(stderr, data.sim);
+	if (arg_trace)
+		trace_dump(lubi_priv, arg_trace);
+
+	return ret;
 }
@@ -0,0 +1,187 @@
+/*
+ * NAND timing model of the example program
+ *
+ * Each flash_read is charged what it would cost on a raw NAND: a page load
+ * (tR) for each page not already in a page register, a column change to
+ * read a page register from another offset, and the transfer of the bytes
+ * over the bus; with cache reads, the load of the next page of a block
+ * overlaps the transfer of the current one, with multi-plane reads, the
+ * same page of the blocks of all the planes is loaded at once
+ *
+ * The elapsed time is accounted per phase, e.g. attach then read
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nand_sim.h"
+
+/**
+ * Parses spec, e.g. "tr=25,bus=40,cache,planes=2", over the defaults of an
+ * asynchronous SLC NAND; "default" keeps them all
+ */
+int nand_sim_parse(struct nand_timing *t, const char *spec)
+{
+	char *s = strdup(spec), *save, *end;
+	int ret = 0;
+
+	t->page_sz = 0;
+	t->tr_us = 25;
+	t->cmd_us = 0.3;
+	t->col_us = 0.3;
+	t->bus_mbs = 40;
+	t->cache_read = 0;
+	t->planes = 1;
+
+	if (!s)
+		return -1;
+
+	for (char *kv = strtok_r(s, ",", &save); kv && !ret;
+	     kv = strtok_r(NULL, ",", &save)) {
+		char *v = strchr(kv, '=');
+		double d = 0;
+
+		if (v) {
+			*v++ = '\0';
+			d = strtod(v, &end);
+			if (end == v || *end || d < 0) {
+				ret = -1;
+				break;
+			}
+		}
+
+		if (!strcmp(kv, "default") && !v)
+			continue;
+		else if (!strcmp(kv, "cache") && !v)
+			t->cache_read = 1;
+		else if (!strcmp(kv, "page") && v)
+			t->page_sz = d;
+		else if (!strcmp(kv, "tr") && v)
+			t->tr_us = d;
+		else if (!strcmp(kv, "cmd") && v)
+			t->cmd_us = d;
+		else if (!strcmp(kv, "col") && v)
+			t->col_us = d;
+		else if (!strcmp(kv, "bus") && v && d > 0)
+			t->bus_mbs = d;
+		else if (!strcmp(kv, "planes") && v && d >= 1 &&
+			 d <= NAND_PLANES_MAX)
+			t->planes = d;
+		else
+			ret = -1;
+	}
+	free(s);
+
+	return ret;
+}
+
+void nand_sim_init(struct nand_sim *sim, const struct nand_timing *t,
+		   int peb_sz)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->t = *t;
+	sim->pages_per_peb = peb_sz / t->page_sz;
+	for (int i = 0; i < NAND_PLANES_MAX; i++)
+		sim->reg[i] = -1;
+	sim->last = -1;
+	nand_sim_phase(sim, "init");
+}
+
+/**
+ * Accounts what follows to phase name, e.g. "attach", the last phase going
+ * on once there are NAND_PHASES_MAX of them
+ */
+void nand_sim_phase(struct nand_sim *sim, const char *name)
+{
+	if ((sim->nb_phases &&
+	     !strcmp(sim->phases[sim->nb_phases - 1].name, name)) ||
+	    sim->nb_phases == NAND_PHASES_MAX)
+		return;
+
+	memset(&sim->phases[sim->nb_phases], 0, sizeof(sim->phases[0]));
+	sim->phases[sim->nb_phases++].name = name;
+}
+
+void nand_sim_read(struct nand_sim *sim, int pnum, int offset, int len)
+{
+	const struct nand_timing *t = &sim->t;
+	struct nand_phase *ph = &sim->phases[sim->nb_phases - 1];
+	int plane = pnum % t->planes;
+
+	while (len > 0) {
+		int p = offset / t->page_sz, col = offset % t->page_sz;
+		int n = t->page_sz - col < len ? t->page_sz - col : len;
+		long long page = (long long)pnum * sim->pages_per_peb + p;
+		double xfer = n / t->bus_mbs;
+
+		if (sim->reg[plane] == page) {
+			// Random data out, unless going on where it stopped
+			if (sim->last != page || sim->last_end != col) {
+				ph->us += t->col_us;
+				ph->cols++;
+			}
+		} else if (t->cache_read && sim->last == page - 1 && p &&
+			   sim->reg[plane] == page - 1) {
+			// Loaded while the previous page was going out
+			ph->us += t->cmd_us;
+			if (t->tr_us > sim->last_xfer_us)
+				ph->us += t->tr_us - sim->last_xfer_us;
+			ph->loads++;
+			sim->reg[plane] = page;
+		} else {
+			ph->us += t->cmd_us + t->tr_us;
+			ph->loads++;
+			sim->reg[plane] = page;
+			// Same page of the blocks of the other planes
+			for (int k = 0; k < t->planes; k++)
+				if (k != plane)
+					sim->reg[k] = (long long)(pnum - plane + k) *
+						      sim->pages_per_peb + p;
+		}
+
+		ph->us += xfer;
+		ph->bytes += n;
+		sim->last = page;
+		sim->last_end = col + n;
+		sim->last_xfer_us = xfer;
+		offset += n;
+		len -= n;
+	}
+}
+
+/**
+ * Simulated time of phase name, of all of them if name is NULL
+ */
+double nand_sim_us(const struct nand_sim *sim, const char *name)
+{
+	double us = 0;
+
+	for (int i = 0; i < sim->nb_phases; i++)
+		if (!name || !strcmp(sim->phases[i].name, name))
+			us += sim->phases[i].us;
+	return us;
+}
+
+void nand_sim_print(FILE *f, const struct nand_sim *sim)
+{
+	const struct nand_timing *t = &sim->t;
+
+	fprintf(f, "simulated NAND: page %d, tR %.1f us, cmd %.2f us, "
+		"col %.2f us, bus %.1f MB/s%s, %d plane%s\n", t->page_sz,
+		t->tr_us, t->cmd_us, t->col_us, t->bus_mbs,
+		t->cache_read ? ", cache read" : "", t->planes,
+		t->planes > 1 ? "s" : "");
+	for (int i = 0; i < sim->nb_phases; i++) {
+		const struct nand_phase *ph = &sim->phases[i];
+
+		if (!ph->bytes)
+			continue;
+		fprintf(f, "  %-8s %10.3f ms - %u page loads, %u column "
+			"changes, %llu bytes\n", ph->name, ph->us / 1e3,
+			ph->loads, ph->cols, ph->bytes);
+	}
+	fprintf(f, "  %-8s %10.3f ms\n", "total", nand_sim_us(sim, NULL) / 1e3);
+}
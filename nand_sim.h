@@ -0,0 +1,51 @@
+/*
+ * NAND timing model of the example program
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef __NAND_SIM_H__
+#define __NAND_SIM_H__
+
+#include <stdio.h>
+
+#define NAND_PLANES_MAX		4
+#define NAND_PHASES_MAX		4
+
+struct nand_timing {
+	int page_sz;
+	double tr_us;			// page load into the page register
+	double cmd_us;			// command and address cycles
+	double col_us;			// column change within the page register
+	double bus_mbs;			// transfer bandwidth, MB/s
+	int cache_read;			// next page loaded during the transfer
+	int planes;			// loaded together by multi-plane reads
+};
+
+struct nand_phase {
+	const char *name;
+	double us;
+	unsigned int loads;		// pages loaded (tR)
+	unsigned int cols;		// column changes
+	unsigned long long bytes;
+};
+
+struct nand_sim {
+	struct nand_timing t;
+	int pages_per_peb;
+	long long reg[NAND_PLANES_MAX];	// page held by each page register
+	long long last;			// page read out last
+	int last_end;			// offset in it where the transfer stopped
+	double last_xfer_us;
+	struct nand_phase phases[NAND_PHASES_MAX];
+	int nb_phases;
+};
+
+int nand_sim_parse(struct nand_timing *t, const char *spec);
+void nand_sim_init(struct nand_sim *sim, const struct nand_timing *t,
+		   int peb_sz);
+void nand_sim_phase(struct nand_sim *sim, const char *name);
+void nand_sim_read(struct nand_sim *sim, int pnum, int offset, int len);
+double nand_sim_us(const struct nand_sim *sim, const char *name);
+void nand_sim_print(FILE *f, const struct nand_sim *sim);
+
+#endif /* !__NAND_SIM_H__ */
@@ -0,0 +1,24 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SZ	32
+
+struct lubi_sha256_ctx {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+};
+
+void lubi_sha256_init(struct lubi_sha256_ctx *ctx);
+void lubi_sha256_update(struct lubi_sha256_ctx *ctx, const void *buf,
+			size_t len);
+void lubi_sha256_final(struct lubi_sha256_ctx *ctx,
+		       uint8_t digest[SHA256_DIGEST_SZ]);
+
+#endif /* !__SHA256_H__ */